@@ -0,0 +1,22 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 3) in vec3 aOffset;
+layout (location = 4) in vec3 aSize;
+layout (location = 5) in vec4 aColor;
+
+layout (std140) uniform Frame
+{
+    mat4 uView;
+    mat4 uProjection;
+    mat4 uViewProjection;
+    vec4 uCameraPosition;
+    float uTime;
+};
+
+out vec4 color;
+
+void main()
+{
+    gl_Position = uViewProjection * vec4(aOffset + aPos * aSize, 1.0f);
+    color = aColor;
+}
\ No newline at end of file
@@ -3,15 +3,22 @@ layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec2 aTexCoord;
 layout (location = 2) in vec3 aNormal;
 
+layout (std140) uniform Frame
+{
+    mat4 uView;
+    mat4 uProjection;
+    mat4 uViewProjection;
+    vec4 uCameraPosition;
+    float uTime;
+};
+
 uniform vec4 uColor;
 uniform mat4 uTrans;
-uniform mat4 uView;
-uniform mat4 uProjection;
 
 out vec4 color;
 
 void main()
 {
-    gl_Position = uProjection * uView * uTrans * vec4(aPos, 1.0f);
+    gl_Position = uViewProjection * uTrans * vec4(aPos, 1.0f);
     color = uColor;
 }
\ No newline at end of file
@@ -0,0 +1,24 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec2 aTexCoord;
+layout (location = 2) in vec3 aNormal;
+layout (location = 3) in mat4 aTrans;
+
+layout (std140) uniform Frame
+{
+    mat4 uView;
+    mat4 uProjection;
+    mat4 uViewProjection;
+    vec4 uCameraPosition;
+    float uTime;
+};
+
+uniform vec4 uColor;
+
+out vec4 color;
+
+void main()
+{
+    gl_Position = uViewProjection * aTrans * vec4(aPos, 1.0f);
+    color = uColor;
+}
\ No newline at end of file
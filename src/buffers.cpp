@@ -0,0 +1,192 @@
+#define MOCHA_BUFFERS
+
+#include <mocha.hpp>
+#include <utils.hpp>
+#include <core.hpp>
+
+namespace
+{
+// wait until the gpu is done reading a region from MAX_BUFFER_REGIONS frames ago
+void waitRegion(mocha::DynamicBufferData& data)
+{
+  GLsync& fence = data.fences[data.region];
+  if (!fence) return;
+
+  GLbitfield flags = 0;
+  while (true)
+  {
+    GLenum result = glClientWaitSync(fence, flags, 1000000);
+    if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED) break;
+    if (result == GL_WAIT_FAILED)
+    {
+      mocha::log(mocha::LogLevel::ERROR, "Dynamic buffer fence wait failed!");
+      break;
+    }
+    // make sure the fence actually gets submitted before waiting again
+    flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+  }
+
+  glDeleteSync(fence);
+  fence = nullptr;
+}
+
+// fence the draws that read the current region and start writing the next one
+void nextRegion(mocha::DynamicBufferData& data)
+{
+  if (data.fences[data.region]) glDeleteSync(data.fences[data.region]);
+  data.fences[data.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  data.region = (data.region + 1) % MAX_BUFFER_REGIONS;
+  data.head = 0;
+}
+}
+
+namespace mocha
+{
+DynamicBuffer createDynamicBuffer(size_t size)
+{
+  DynamicBufferData data = {};
+  data.region_size = size;
+
+  glGenBuffers(1, &data.id);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, data.id);
+  glBufferData(GL_COPY_WRITE_BUFFER, size * MAX_BUFFER_REGIONS, NULL, GL_STREAM_DRAW);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+  core.render.dynamic_buffers.push_back(data);
+  return {(int)core.render.dynamic_buffers.size()-1, data.id};
+}
+
+void* mapDynamicBuffer(DynamicBuffer buffer, size_t bytes, size_t& offset, size_t alignment)
+{
+  DynamicBufferData& data = core.render.dynamic_buffers[buffer.index];
+
+  size_t head = (data.head + alignment - 1) / alignment * alignment;
+  if (head + bytes > data.region_size)
+  {
+    log(LogLevel::WARNING, "Dynamic buffer region full!");
+    return nullptr;
+  }
+
+  waitRegion(data);
+
+  offset = data.region * data.region_size + head;
+  data.head = head + bytes;
+
+  // the fence guarantees the gpu is done with this range, so the driver does not need to sync
+  glBindBuffer(GL_COPY_WRITE_BUFFER, data.id);
+  return glMapBufferRange(GL_COPY_WRITE_BUFFER, offset, bytes,
+    GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+}
+
+void unmapDynamicBuffer(DynamicBuffer buffer)
+{
+  glBindBuffer(GL_COPY_WRITE_BUFFER, buffer.id);
+  glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+bool pushDynamicBuffer(DynamicBuffer buffer, const void* src, size_t bytes, size_t& offset, size_t alignment)
+{
+  void* dst = mapDynamicBuffer(buffer, bytes, offset, alignment);
+  if (!dst) return false;
+
+  memcpy(dst, src, bytes);
+  unmapDynamicBuffer(buffer);
+  return true;
+}
+
+// bytes a push with this alignment can still take from the current region
+size_t getDynamicBufferSpace(DynamicBuffer buffer, size_t alignment)
+{
+  const DynamicBufferData& data = core.render.dynamic_buffers[buffer.index];
+  size_t head = (data.head + alignment - 1) / alignment * alignment;
+  return head < data.region_size ? data.region_size - head : 0;
+}
+
+// move to the next region before the frame ends, waits if the gpu still reads it
+void cycleDynamicBuffer(DynamicBuffer buffer)
+{
+  nextRegion(core.render.dynamic_buffers[buffer.index]);
+}
+
+// sub allocate a mesh from the shared pool of its vertex format and index type, false if it does not fit
+bool allocPooled(const void* vertices, size_t vertex_count, const void* indices, size_t index_count, Model& m)
+{
+  size_t stride = vertexStride(m.format);
+  size_t index_size = indexSize(m.index_type);
+
+  int index = -1;
+  for (size_t i=0; i<core.render.pools.size(); i++)
+  {
+    const ModelPool& pool = core.render.pools[i];
+    if (pool.format == m.format && pool.index_type == m.index_type) index = i;
+  }
+
+  // pool not initialized
+  if (index < 0)
+  {
+    ModelPool pool = {};
+    pool.format = m.format;
+    pool.index_type = m.index_type;
+    pool.vertex_capacity = POOL_VERTEX_BYTES / stride;
+    pool.index_capacity = POOL_INDEX_BYTES / index_size;
+
+    glGenVertexArrays(1, &pool.vao);
+    glGenBuffers(1, &pool.vbo);
+    glGenBuffers(1, &pool.ebo);
+
+    glBindVertexArray(pool.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, pool.vbo);
+    glBufferData(GL_ARRAY_BUFFER, POOL_VERTEX_BYTES, NULL, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, POOL_INDEX_BYTES, NULL, GL_STATIC_DRAW);
+
+    setVertexAttribs(pool.format);
+
+    // per instance transform, pointers are set on flush
+    for (int i=0; i<4; i++)
+    {
+      glEnableVertexAttribArray(POOL_TRANS_ATTRIB + i);
+      glVertexAttribDivisor(POOL_TRANS_ATTRIB + i, 1);
+    }
+
+    glBindVertexArray(0);
+    core.render.pools.push_back(pool);
+    index = core.render.pools.size()-1;
+  }
+
+  ModelPool& pool = core.render.pools[index];
+  if (pool.vertex_count + vertex_count > pool.vertex_capacity
+  ||  pool.index_count + index_count > pool.index_capacity)
+  {
+    log(LogLevel::WARNING, "Model pool full, using own buffers!");
+    return false;
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, pool.vbo);
+  glBufferSubData(GL_ARRAY_BUFFER, pool.vertex_count * stride, vertex_count * stride, vertices);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  // element array binding is vao state
+  glBindVertexArray(pool.vao);
+  glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, pool.index_count * index_size, index_count * index_size, indices);
+  glBindVertexArray(0);
+
+  m.vao = pool.vao;
+  m.indices_count = index_count;
+  m.first_index = pool.index_count;
+  m.base_vertex = pool.vertex_count;
+  m.pool = index;
+
+  pool.vertex_count += vertex_count;
+  pool.index_count += index_count;
+  return true;
+}
+
+// called once per frame after all draws have been submitted
+void advanceDynamicBuffers()
+{
+  for (DynamicBufferData& data : core.render.dynamic_buffers) nextRegion(data);
+}
+
+}
@@ -6,6 +6,219 @@
 #define MAX_KEYS          512
 #define MAX_MOUSE_BUTTONS 8
 #define MAX_GAMEPADS      4
+#define INPUT_QUEUE_SIZE  1024    // events between two frames before dropping
+#define INPUT_RECORD_VERSION 3
+#define GAMEPAD_BUTTONS   15
+#define GAMEPAD_AXES      6
+#define GAMEPAD_CODE_STRIDE 32    // gamepad event code is pad * stride + button or axis
+#define FRAME_HISTORY     240
+#define MAX_FIXED_STEPS   8
+#define PACER_SPIN_MARGIN 0.001   // seconds spun instead of slept before a frame
+#define MAX_BUFFER_REGIONS 3
+#define FRAME_UBO_BINDING  0
+#define POOL_VERTEX_BYTES  (64 * 1024 * 1024)
+#define POOL_INDEX_BYTES   (32 * 1024 * 1024)
+#define POOL_TRANS_ATTRIB  3
+#define GPU_QUERY_FRAMES   3
+#define CPU_TRACE_CAPACITY (1024 * 1024)   // ring slots per thread, zones are dropped while it is full
+#define LUA_SIZE_CLASSES   10
+#define LUA_PAGE_SIZE      (64 * 1024)
+#define LOD_MIN_TRIANGLES  64     // meshes below this are not simplified
+#define LOD_SCREEN_SIZE    0.5f   // projected height (in screens) where lod 1 starts
+
+namespace mocha 
+{
+// Backing data of a DynamicBuffer, one region per frame in flight
+struct DynamicBufferData {
+  unsigned int id;
+  size_t       region_size;
+  size_t       head;
+  int          region;
+  GLsync       fences[MAX_BUFFER_REGIONS];
+};
+
+// Per frame uniform block, layout matches "Frame" (std140) in the shaders
+struct FrameData {
+  glm::mat4 view;
+  glm::mat4 projection;
+  glm::mat4 view_projection;
+  glm::vec4 camera_position;
+  float     time;
+  float     padding[3];
+};
+
+// Batched primitives, flushed once per frame in End
+struct BatchInstance {
+  glm::vec3 pos;
+  glm::vec3 size;
+  Color     color;
+};
+
+struct BatchVertex {
+  glm::vec3 pos;
+  Color     color;
+};
+
+// Shared buffers for pooled models, sub allocated front to back
+struct ModelPool {
+  int          format;
+  unsigned int index_type;
+  unsigned int vao;
+  unsigned int vbo;
+  unsigned int ebo;
+  size_t       vertex_count;
+  size_t       vertex_capacity;
+  size_t       index_count;
+  size_t       index_capacity;
+};
+
+struct StaticDraw {
+  Model     model;
+  glm::mat4 trans;
+};
+
+// Mesh range of a renderable entity, sorted by key before submission
+struct RenderItem {
+  uint64_t     key;
+  int          shader;
+  unsigned int vao;
+  unsigned int index_type;
+  int          pool;
+  int          first_index;
+  int          base_vertex;
+  int          indices_count;
+  uint32_t     trans;   // into render_transforms, the vertex decode is already applied
+};
+
+// Unpooled model draw, replayed with its shader on the render thread
+struct ModelDraw {
+  Shader    shader;
+  Model     model;
+  glm::mat4 trans;
+  bool      has_trans;
+};
+
+// Uniform set recorded by the simulation, replayed right before models[draw]
+struct UniformSet {
+  Shader                shader;
+  size_t                draw;
+  std::function<void()> set;
+};
+
+// Everything needed to draw one frame, filled by the simulation and consumed by the renderer
+struct RenderPacket {
+  FrameData                  frame;
+  bool                       has_frame;
+  std::vector<ModelDraw>     models;
+  std::vector<UniformSet>    uniforms;
+  std::vector<StaticDraw>    static_draws;
+  std::vector<BatchInstance> cubes;
+  std::vector<BatchInstance> spheres;
+  std::vector<BatchVertex>   lines;
+  std::string                screenshot;
+  std::vector<std::function<void()>> tasks;   // gl calls deferred by the simulation
+};
+
+// Timestamp pair of one gpu zone
+struct GpuZoneQuery {
+  const char*  name;
+  unsigned int begin;
+  unsigned int end;
+};
+
+// Queries of one frame, read back GPU_QUERY_FRAMES frames later
+struct GpuFrame {
+  std::vector<unsigned int> queries;
+  size_t                    used;
+  std::vector<GpuZoneQuery> zones;
+};
+
+struct CpuZoneEvent {
+  const char* name;
+  uint64_t    start;
+  uint64_t    end;
+};
+
+// Single producer ring of the zones one thread recorded, readers see [start, head)
+struct ThreadTrace {
+  int                             tid;
+  std::unique_ptr<CpuZoneEvent[]> events;
+  std::atomic<uint64_t>           head;      // written by the owning thread only
+  std::atomic<uint64_t>           start;     // moved up to head by clearTrace
+  std::atomic<size_t>             dropped;
+};
+
+// Size class pools behind the lua allocator, blocks are never returned to the system while the state lives
+struct LuaArena {
+  void*              free_lists[LUA_SIZE_CLASSES];
+  std::vector<char*> pages;
+  char*              cursor;
+  size_t             page_left;
+  LuaMemoryStats     stats;
+};
+
+enum InputEventType {
+  kInputKey = 0,
+  kInputMouseButton,
+  kInputCursor,             // x, y window position
+  kInputScroll,             // x, y offset
+  kInputGamepadButton,
+  kInputGamepadAxis,        // x value
+  kInputGamepadConnection,  // GLFW_CONNECTED or GLFW_DISCONNECTED
+};
+
+// Raw event from a glfw callback or gamepad poll, applied to the input state in Begin
+struct InputEvent {
+  double time;
+  int    type;
+  int    code;
+  int    action;
+  float  x;
+  float  y;
+};
+
+// Polled gamepad snapshot
+struct GamepadData {
+  bool  connected;
+  bool  current_buttons[GAMEPAD_BUTTONS];
+  bool  previous_buttons[GAMEPAD_BUTTONS];
+  bool  pressed_buttons[GAMEPAD_BUTTONS];
+  bool  released_buttons[GAMEPAD_BUTTONS];
+  float axes[GAMEPAD_AXES];
+};
+
+// InputBindings entry compiled into the per key action table
+struct ActionBinding {
+  int      key;
+  KeyState state;
+  Entity   entity;
+  Command* command;
+};
+
+// Component type exposed to lua, accessors are instantiated by luaComponent
+struct LuaComponent {
+  const char*           name;
+  std::vector<LuaField> fields;
+  void*  (*get)(Entity e);
+  bool   (*has)(Entity e);
+  void   (*emplace)(Entity e);
+  size_t (*version)();
+  const size_t* (*version_address)();
+  const std::vector<Entity>& (*entities)();
+  void*  (*data)();   // dense components, same order as entities
+  void   (*sync)(void* component);   // after lua wrote a field, keeps derived members in step
+  size_t size;
+};
+
+// Same layout as DrawElementsIndirectCommand
+struct DrawCommand {
+  unsigned int count;
+  unsigned int instance_count;
+  unsigned int first_index;
+  int          base_vertex;
+  unsigned int base_instance;
+};
+}
 
 namespace mocha 
 {
@@ -21,11 +234,30 @@ struct Core {
     double previous;
     double delta;
     double fps;
+
+    // Pacing
+    FrameMode frame_mode;
+    double    deadline;
+    double    wake_error;
+    double    frame_history[FRAME_HISTORY];
+    double    wake_history[FRAME_HISTORY];
+
+    // Headless
+    bool   headless;
+    struct {
+      unsigned int fbo;
+      unsigned int color;
+      unsigned int depth;
+    } offscreen;
+    int    frame;
+    int    max_frames;
+    std::vector<double> frame_times;
   } window;
 
   struct {
     // Shader
     Shader    current_shader;
+    Shader    bound_shader;     // program bound on the gl thread
 
     // Cam
     glm::vec3 world_up;
@@ -34,28 +266,196 @@ struct Core {
     Entity*   cam_debug;
     Entity*   cam_current;
 
+    // Buffers
+    std::vector<DynamicBufferData> dynamic_buffers;
+
+    // Frame uniforms
+    FrameData     frame;
+    DynamicBuffer frame_buffer;
+    int           frame_alignment;
+
+    // Renderables extracted from the ecs after update
+    std::vector<RenderItem> render_list;
+    std::vector<glm::mat4>  render_transforms;
+
+    // Draws of the frame being simulated, the other packet may be rendering
+    RenderPacket packets[2];
+    int          sim_packet;
+
+    // Pooled models
+    std::vector<ModelPool>   pools;
+    std::vector<DrawCommand> static_commands;
+    std::vector<glm::mat4>   static_instances;
+
   } render;
 
   struct {
     const char* path;
+    const char* scripts;
+    const char* cache;
   } assets;
 
+  struct {
+    lua_State* state;
+    std::vector<LuaComponent> components;
+    std::string current_script;   // script running right now, systems are tagged with it
+    int         cache_hits;
+    int         cache_misses;
+
+    // Memory
+    LuaArena memory;
+    double   gc_budget;   // ms of collection per frame, 0 lets lua collect on its own
+
+    // Hot reload
+    bool   reload;
+    int    watch_fd;
+    double poll_time;
+    std::unordered_map<std::string, int64_t> write_times;
+  } lua;
+
+  struct {
+    bool            enabled;
+    std::thread     thread;
+    std::thread::id render_id;   // published by the render thread before setPipelined returns
+    bool            started;
+    std::mutex      mutex;
+    std::condition_variable cv;
+    bool            submitted;
+    bool            quit;
+    int             render_packet;
+    std::vector<std::function<void()>> tasks;   // blocking calls from the simulation
+  } pipeline;
+
+  struct {
+    // Gpu
+    bool     gpu_enabled;
+    bool     gpu_overlay;
+    double   overlay_time;
+    GpuFrame gpu_frames[GPU_QUERY_FRAMES];
+    int      gpu_frame;
+    std::vector<size_t>   gpu_stack;
+    std::vector<ZoneTime> gpu_results;
+
+    // Cpu
+    bool     cpu_enabled;
+    uint64_t origin;
+    std::mutex                      threads_mutex;
+    std::vector<ThreadTrace*>       threads;
+    std::unordered_set<std::string> names;
+
+    // Lua sampling
+    bool        lua_enabled;
+    int         lua_interval;   // vm instructions between samples
+    uint64_t    lua_last;
+    uint64_t    lua_run_start;
+    const char* lua_current;
+    std::vector<LuaFunctionTime> lua_functions;
+    std::unordered_map<const char*, size_t> lua_lookup;
+    // (chunk source, line defined) -> lua_functions, dropped whenever a script is loaded
+    std::map<std::pair<const char*, int>, size_t> lua_sources;
+    std::pair<const char*, int> lua_last_source;
+    size_t                      lua_last_function;
+  } profiler;
+
   struct {
     bool current_key_states[MAX_KEYS];
     bool previous_key_states[MAX_KEYS];
+    bool pressed_keys[MAX_KEYS];    // edges seen this frame, a tap inside one frame sets both
+    bool released_keys[MAX_KEYS];
+
+    // Event queue, filled by callbacks and drained once per frame
+    InputEvent events[INPUT_QUEUE_SIZE];
+    size_t     head;
+    size_t     tail;
+    size_t     dropped;
+    std::vector<int> changed_keys;   // keys with events this frame
+    std::vector<int> down_keys;
+
+    // Recording and replay of the drained events
+    std::vector<InputEvent> frame_events;
+    std::ofstream record;
+    std::ifstream replay;
+    bool          recording;
+    bool          replaying;
+    bool          replay_done;
+
+    // Action map, bindings grouped by key, rebuilt when InputBindings are added or removed
+    std::vector<ActionBinding> actions;
+    std::vector<ActionBinding> up_actions;   // fire every frame the key is up
+    size_t actions_offset[MAX_KEYS+1];
+    size_t actions_version = SIZE_MAX;
 
     bool current_mouse_button_states[MAX_MOUSE_BUTTONS];
     bool previous_mouse_button_states[MAX_MOUSE_BUTTONS];
+    bool pressed_mouse_buttons[MAX_MOUSE_BUTTONS];
+    bool released_mouse_buttons[MAX_MOUSE_BUTTONS];
+
+    // Mouse motion summed over the frame
+    glm::vec2 mouse_position;
+    glm::vec2 mouse_delta;
+    glm::vec2 scroll;
+    bool      has_mouse_position;
+
+    GamepadData gamepads[MAX_GAMEPADS];
   } input;
 
   struct {
     std::unordered_map<std::type_index, void*> sets;
     Entity next_entity = 0;
     std::vector<System*> systems;
+    std::vector<const char*> system_names;
+
+    // Fixed timestep
+    std::vector<System*> fixed_systems;
+    std::vector<const char*> fixed_system_names;
+    std::vector<System*> input_systems;   // run before the fixed steps of the frame
+    std::vector<const char*> input_system_names;
+    double tick = 1.0/60.0;
+    double accumulator;
+    double alpha;
   } ecs;
 };
 // Define global core
 extern Core core;
+
+// Internal functions shared between modules
+inline RenderPacket& simPacket() { return core.render.packets[core.render.sim_packet]; }
+
+void advanceDynamicBuffers();
+void uploadFrameData(const FrameData& frame);
+void flushBatch(RenderPacket& packet);
+void flushStatic(RenderPacket& packet);
+void flushModels(RenderPacket& packet);
+void extractRenderList();
+void submitRenderList();
+void presentPacket(RenderPacket& packet);
+bool onRenderThread();
+void runOnRenderThread(const std::function<void()>& task);
+bool deferToRenderThread(const std::function<void()>& task);
+void submitPacket();
+void stopPipeline();
+void advanceGpuProfiler();
+uint64_t    profilerNow();
+void        recordZone(const char* name, uint64_t start, uint64_t end);
+const char* internName(const std::string& name);
+const char* typeName(const std::type_info& type);
+void        luaProfileBegin();
+void        luaProfileEnd();
+void        forgetLuaSources();
+void        applyLuaProfiler();
+size_t vertexStride(int format);
+size_t indexSize(unsigned int type);
+void   setVertexAttribs(int format);
+bool   allocPooled(const void* vertices, size_t vertex_count, const void* indices, size_t index_count, Model& m);
+void initSystems();
+void registerLuaComponent(const LuaComponent& component);
+void closeLua();
+void pollScripts();
+void pushInputEvent(const InputEvent& event);
+void drainInput();
+void* luaAlloc(void* ud, void* ptr, size_t osize, size_t nsize);
+void  stepLuaGC();
+void  freeLuaArena();
 }
 
 #endif
\ No newline at end of file
@@ -7,35 +7,29 @@
 
 namespace
 {
-mocha::Model cube;
+mocha::Model  cube;
+mocha::Model  sphere;
+unsigned int  lines_vao;
+mocha::Shader batch_shader;
+mocha::DynamicBuffer batch_buffer;
+mocha::Shader static_shader;
+mocha::DynamicBuffer static_buffer;
 
-void initCube()
-{
-  float vertices[] = {
-     1, -1, -1,
-     1, -1,  1,
-    -1, -1,  1,
-    -1, -1, -1,
-     1,  1, -1, 
-     1,  1,  1,
-    -1,  1,  1,
-    -1,  1, -1
-  };
-  unsigned int indices[] = {
-    5, 1, 4,
-    5, 4, 8,
-    3, 7, 8,
-    3, 8, 4,
-    2, 6, 3,
-    6, 7, 3,
-    1, 5, 2,
-    5, 6, 2,
-    5, 8, 6,
-    8, 7, 6,
-    1, 2, 3,
-    1, 3, 4
-  };
+const size_t BATCH_BUFFER_SIZE = 16 * 1024 * 1024;
+const int    SPHERE_RINGS      = 8;
+const int    SPHERE_SEGMENTS   = 12;
+const size_t STATIC_BUFFER_SIZE = 16 * 1024 * 1024;
 
+// batch attributes, see assets/shaders/batch.vs
+enum BatchAttrib {
+  kBatchPos    = 0,
+  kBatchOffset = 3,
+  kBatchSize   = 4,
+  kBatchColor  = 5,
+};
+
+mocha::Model initPrimitive(const std::vector<float>& vertices, const std::vector<unsigned short>& indices)
+{
   unsigned int vao, vbo, ebo;
   glGenVertexArrays(1, &vao);
   glGenBuffers(1, &vbo);
@@ -44,18 +38,200 @@ void initCube()
   glBindVertexArray(vao);
   glBindBuffer(GL_ARRAY_BUFFER, vbo);
 
-  glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
 
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), &indices[0], GL_STATIC_DRAW);
+
+  glEnableVertexAttribArray(kBatchPos);
+  glVertexAttribPointer(kBatchPos, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), (void*)0);
+
+  // per instance data, pointers are set on flush
+  glEnableVertexAttribArray(kBatchOffset);
+  glEnableVertexAttribArray(kBatchSize);
+  glEnableVertexAttribArray(kBatchColor);
+  glVertexAttribDivisor(kBatchOffset, 1);
+  glVertexAttribDivisor(kBatchSize, 1);
+  glVertexAttribDivisor(kBatchColor, 1);
+
+  glBindVertexArray(0);
+
+  mocha::Model m;
+  m.vao = vao;
+  m.indices_count = indices.size();
+  m.index_type = GL_UNSIGNED_SHORT;
+  return m;
+}
+
+void initCube()
+{
+  std::vector<float> vertices = {
+     0.5f, -0.5f, -0.5f,
+     0.5f, -0.5f,  0.5f,
+    -0.5f, -0.5f,  0.5f,
+    -0.5f, -0.5f, -0.5f,
+     0.5f,  0.5f, -0.5f, 
+     0.5f,  0.5f,  0.5f,
+    -0.5f,  0.5f,  0.5f,
+    -0.5f,  0.5f, -0.5f
+  };
+  std::vector<unsigned short> indices = {
+    4, 0, 3,
+    4, 3, 7,
+    2, 6, 7,
+    2, 7, 3,
+    1, 5, 2,
+    5, 6, 2,
+    0, 4, 1,
+    4, 5, 1,
+    4, 7, 5,
+    7, 6, 5,
+    0, 1, 2,
+    0, 2, 3
+  };
 
-  glEnableVertexAttribArray(0);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), (void*)0);
+  cube = initPrimitive(vertices, indices);
+}
+
+void initSphere()
+{
+  std::vector<float>          vertices;
+  std::vector<unsigned short> indices;
+
+  for (int r=0; r<=SPHERE_RINGS; r++)
+  {
+    float phi = glm::pi<float>() * r / SPHERE_RINGS;
+    for (int s=0; s<=SPHERE_SEGMENTS; s++)
+    {
+      float theta = 2.0f * glm::pi<float>() * s / SPHERE_SEGMENTS;
+      vertices.push_back(sin(phi) * cos(theta));
+      vertices.push_back(cos(phi));
+      vertices.push_back(sin(phi) * sin(theta));
+    }
+  }
+
+  for (int r=0; r<SPHERE_RINGS; r++)
+  {
+    for (int s=0; s<SPHERE_SEGMENTS; s++)
+    {
+      unsigned short a = r * (SPHERE_SEGMENTS+1) + s;
+      unsigned short b = a + SPHERE_SEGMENTS + 1;
+      indices.insert(indices.end(), {a, b, (unsigned short)(a+1), (unsigned short)(a+1), b, (unsigned short)(b+1)});
+    }
+  }
+
+  sphere = initPrimitive(vertices, indices);
+}
 
+void initBatch()
+{
+  batch_shader = mocha::loadShader("batch");
+  batch_buffer = mocha::createDynamicBuffer(BATCH_BUFFER_SIZE);
+
+  initCube();
+  initSphere();
+
+  glGenVertexArrays(1, &lines_vao);
+  glBindVertexArray(lines_vao);
+  glEnableVertexAttribArray(kBatchPos);
+  glEnableVertexAttribArray(kBatchColor);
   glBindVertexArray(0);
+}
 
-  cube.vao = vao;
-  cube.indices_count = (int)(sizeof(indices)/sizeof(*indices));
+// elements of this size that still fit the batch buffer, a full region is fenced and the next one used
+size_t batchSpace(size_t size, size_t min_count)
+{
+  size_t fit = mocha::getDynamicBufferSpace(batch_buffer, size) / size;
+  if (fit < min_count)
+  {
+    mocha::cycleDynamicBuffer(batch_buffer);
+    fit = mocha::getDynamicBufferSpace(batch_buffer, size) / size;
+  }
+  return fit;
+}
+
+// keeps a uniform set from the simulation in order with the model draws around it
+bool deferUniform(mocha::Shader shader, const std::function<void()>& set)
+{
+  using namespace mocha;
+  if (onRenderThread()) return false;
+  simPacket().uniforms.push_back({shader, simPacket().models.size(), set});
+  return true;
+}
+
+void bindShader(mocha::Shader shader)
+{
+  using namespace mocha;
+  if (shader.id == core.render.bound_shader.id) return;
+  core.render.bound_shader = shader;
+  glUseProgram(shader.id);
+}
+
+// one instanced draw per buffer region worth of instances
+void flushInstances(mocha::Model m, const std::vector<mocha::BatchInstance>& instances)
+{
+  using mocha::BatchInstance;
+
+  glBindVertexArray(m.vao);
+  glBindBuffer(GL_ARRAY_BUFFER, batch_buffer.id);
+
+  size_t done = 0;
+  while (done < instances.size())
+  {
+    size_t count = std::min(instances.size() - done, batchSpace(sizeof(BatchInstance), 1));
+
+    size_t offset;
+    if (count == 0 || !mocha::pushDynamicBuffer(batch_buffer, &instances[done], 
+                                               count * sizeof(BatchInstance), offset, sizeof(BatchInstance)))
+    {
+      mocha::log(mocha::LogLevel::WARNING, "Batch buffer full, primitives dropped!");
+      break;
+    }
+
+    glVertexAttribPointer(kBatchOffset, 3, GL_FLOAT, GL_FALSE, sizeof(BatchInstance), 
+                          (void*)(offset + offsetof(BatchInstance, pos)));
+    glVertexAttribPointer(kBatchSize, 3, GL_FLOAT, GL_FALSE, sizeof(BatchInstance), 
+                          (void*)(offset + offsetof(BatchInstance, size)));
+    glVertexAttribPointer(kBatchColor, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(BatchInstance), 
+                          (void*)(offset + offsetof(BatchInstance, color)));
+
+    glDrawElementsInstanced(GL_TRIANGLES, m.indices_count, m.index_type, 0, count);
+    done += count;
+  }
+}
+
+void flushLines(const std::vector<mocha::BatchVertex>& lines)
+{
+  using mocha::BatchVertex;
+
+  glBindVertexArray(lines_vao);
+  glBindBuffer(GL_ARRAY_BUFFER, batch_buffer.id);
+
+  // lines are not instanced, use constant instance attributes
+  glVertexAttrib3f(kBatchOffset, 0.0f, 0.0f, 0.0f);
+  glVertexAttrib3f(kBatchSize, 1.0f, 1.0f, 1.0f);
+
+  size_t done = 0;
+  while (done < lines.size())
+  {
+    size_t count = std::min(lines.size() - done, batchSpace(sizeof(BatchVertex), 2) & ~(size_t)1);
+
+    size_t offset;
+    if (count == 0 || !mocha::pushDynamicBuffer(batch_buffer, &lines[done], 
+                                               count * sizeof(BatchVertex), offset, sizeof(BatchVertex)))
+    {
+      mocha::log(mocha::LogLevel::WARNING, "Batch buffer full, lines dropped!");
+      break;
+    }
+
+    glVertexAttribPointer(kBatchPos, 3, GL_FLOAT, GL_FALSE, sizeof(BatchVertex), 
+                          (void*)(offset + offsetof(BatchVertex, pos)));
+    glVertexAttribPointer(kBatchColor, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(BatchVertex), 
+                          (void*)(offset + offsetof(BatchVertex, color)));
+
+    glDrawArrays(GL_LINES, 0, count);
+    done += count;
+  }
 }
 }
 
@@ -68,66 +244,369 @@ void clearColor(Color color)
 
 void drawModel(Model m)
 {
+  if (!onRenderThread())
+  {
+    simPacket().models.push_back({core.render.current_shader, m, glm::mat4(1.0f), false});
+    return;
+  }
+
   glBindVertexArray(m.vao);
-  glDrawElements(GL_TRIANGLES, m.indices_count, GL_UNSIGNED_INT, 0);
+  glDrawElementsBaseVertex(GL_TRIANGLES, m.indices_count, m.index_type, 
+                           (void*)(m.first_index * indexSize(m.index_type)), m.base_vertex);
   glBindVertexArray(0);
 }
 
 void drawModel(Model m, glm::mat4 trans)
 {
-  shaderSet(core.render.current_shader, "uTrans", trans);
+  // pooled models are collected and submitted together in End
+  if (m.pool >= 0)
+  {
+    simPacket().static_draws.push_back({m, trans * getDecodeTransform(m)});
+    return;
+  }
+
+  if (!onRenderThread())
+  {
+    simPacket().models.push_back({core.render.current_shader, m, trans, true});
+    return;
+  }
+
+  shaderSet(core.render.bound_shader, "uTrans", trans * getDecodeTransform(m));
   drawModel(m);
 }
 
+Model getLod(Model m, int lod)
+{
+  lod = std::clamp(lod, 0, m.lod_count-1);
+  m.indices_count = m.lods[lod].indices_count;
+  m.first_index = m.lods[lod].first_index;
+  return m;
+}
+
+// pick the lod from the projected height of the bounding sphere
+int selectLod(const Model& m, glm::mat4 trans)
+{
+  if (m.lod_count <= 1) return 0;
+
+  glm::vec3 center = trans * glm::vec4(m.center, 1.0f);
+  float scale = std::max({glm::length(glm::vec3(trans[0])), 
+                          glm::length(glm::vec3(trans[1])), 
+                          glm::length(glm::vec3(trans[2]))});
+  float radius = m.radius * scale;
+  float distance = glm::length(center - glm::vec3(core.render.frame.camera_position));
+  if (distance <= radius) return 0;
+
+  // projection[1][1] is 1/tan(fov/2)
+  float size = radius * core.render.frame.projection[1][1] / distance;
+
+  int lod = 0;
+  float threshold = LOD_SCREEN_SIZE;
+  while (lod+1 < m.lod_count && size < threshold)
+  {
+    lod++;
+    threshold *= 0.5f;
+  }
+  return lod;
+}
+
 void drawCube(glm::vec3 pos, glm::vec3 size, Color color)
 {
-  // cube not initialized
+  simPacket().cubes.push_back({pos, size, color});
+}
+
+void drawSphere(glm::vec3 center, float radius, Color color)
+{
+  simPacket().spheres.push_back({center, glm::vec3(radius), color});
+}
+
+void drawLine(glm::vec3 start, glm::vec3 end, Color color)
+{
+  simPacket().lines.push_back({start, color});
+  simPacket().lines.push_back({end, color});
+}
+
+void drawBoundingBox(glm::vec3 min, glm::vec3 max, Color color)
+{
+  glm::vec3 c[8] = {
+    {min.x, min.y, min.z}, {max.x, min.y, min.z}, {max.x, min.y, max.z}, {min.x, min.y, max.z},
+    {min.x, max.y, min.z}, {max.x, max.y, min.z}, {max.x, max.y, max.z}, {min.x, max.y, max.z}
+  };
+
+  for (int i=0; i<4; i++)
+  {
+    drawLine(c[i], c[(i+1)%4], color);
+    drawLine(c[i+4], c[(i+1)%4+4], color);
+    drawLine(c[i], c[i+4], color);
+  }
+}
+
+void drawGrid(int slices, float spacing)
+{
+  float half = slices * spacing * 0.5f;
+  Color color = {128, 128, 128, 255};
+
+  for (int i=0; i<=slices; i++)
+  {
+    float p = -half + i * spacing;
+    drawLine({p, 0.0f, -half}, {p, 0.0f, half}, color);
+    drawLine({-half, 0.0f, p}, {half, 0.0f, p}, color);
+  }
+}
+
+// walk the sorted render list, switching shaders only between runs
+void submitRenderList()
+{
+  MOCHA_GPU_ZONE("render list")
+  Shader previous = core.render.current_shader;
+
+  for (const RenderItem& item : core.render.render_list)
+  {
+    if (item.shader != core.render.current_shader.id) shaderUse({item.shader});
+
+    // the transform already decodes packed vertices, so the model is drawn as float
+    Model m;
+    m.vao = item.vao;
+    m.index_type = item.index_type;
+    m.pool = item.pool;
+    m.first_index = item.first_index;
+    m.base_vertex = item.base_vertex;
+    m.indices_count = item.indices_count;
+    drawModel(m, core.render.render_transforms[item.trans]);
+  }
+
+  if (previous.id != core.render.current_shader.id) shaderUse(previous);
+}
+
+// unpooled models and uniform sets recorded by the simulation thread, in their recorded order
+void flushModels(RenderPacket& packet)
+{
+  size_t next = 0;
+  for (size_t i=0; i<=packet.models.size(); i++)
+  {
+    // glUniform goes to the bound program, so a replayed set binds its shader first
+    for (; next < packet.uniforms.size() && packet.uniforms[next].draw == i; next++)
+    {
+      bindShader(packet.uniforms[next].shader);
+      packet.uniforms[next].set();
+    }
+    if (i == packet.models.size()) break;
+
+    const ModelDraw& d = packet.models[i];
+    bindShader(d.shader);
+    if (d.has_trans)
+    {
+      drawModel(d.model, d.trans);
+    } else {
+      drawModel(d.model);
+    }
+  }
+  packet.models.clear();
+  packet.uniforms.clear();
+}
+
+void flushStatic(RenderPacket& packet)
+{
+  auto& draws = packet.static_draws;
+  if (draws.empty()) return;
+
+  // static drawing not initialized
+  if (static_shader.id == 0)
+  {
+    static_shader = loadShader("static");
+    static_buffer = createDynamicBuffer(STATIC_BUFFER_SIZE);
+  }
+
+  // group equal meshes so every mesh becomes one instanced command
+  std::sort(draws.begin(), draws.end(), [](const StaticDraw& a, const StaticDraw& b) {
+    if (a.model.pool != b.model.pool) return a.model.pool < b.model.pool;
+    return a.model.first_index < b.model.first_index;
+  });
+
+  auto& commands = core.render.static_commands;
+  auto& instances = core.render.static_instances;
+  commands.clear();
+  instances.clear();
+
+  for (const StaticDraw& d : draws)
+  {
+    DrawCommand* last = commands.empty() ? nullptr : &commands.back();
+    if (last && last->first_index == (unsigned int)d.model.first_index 
+    &&  draws[last->base_instance].model.pool == d.model.pool)
+    {
+      last->instance_count++;
+    } else {
+      commands.push_back({(unsigned int)d.model.indices_count, 1, (unsigned int)d.model.first_index,
+                          d.model.base_vertex, (unsigned int)instances.size()});
+    }
+    instances.push_back(d.trans);
+  }
+
+  glUseProgram(static_shader.id);
+  shaderSet(static_shader, "uColor", WHITE);
+
+  // instances are uploaded in chunks that fit the region, a command can span two chunks
+  int pool = -1;
+  size_t next = 0;
+  size_t done = 0;
+  while (done < instances.size())
+  {
+    size_t fit = getDynamicBufferSpace(static_buffer) / sizeof(glm::mat4);
+    if (fit == 0)
+    {
+      cycleDynamicBuffer(static_buffer);
+      fit = getDynamicBufferSpace(static_buffer) / sizeof(glm::mat4);
+    }
+    size_t count = std::min(instances.size() - done, fit);
+
+    size_t offset;
+    if (count == 0 || !pushDynamicBuffer(static_buffer, &instances[done], count * sizeof(glm::mat4), offset))
+    {
+      log(LogLevel::WARNING, "Static buffer full, models dropped!");
+      break;
+    }
+
+    while (next < commands.size())
+    {
+      const DrawCommand& c = commands[next];
+      if (c.base_instance >= done + count) break;
+      int cmd_pool = draws[c.base_instance].model.pool;
+      if (cmd_pool != pool)
+      {
+        pool = cmd_pool;
+        glBindVertexArray(core.render.pools[pool].vao);
+        glBindBuffer(GL_ARRAY_BUFFER, static_buffer.id);
+      }
+
+      size_t first = std::max((size_t)c.base_instance, done);
+      size_t last = std::min((size_t)c.base_instance + c.instance_count, done + count);
+
+      // no base instance before gl 4.2, move the instance pointers instead
+      size_t base = offset + (first - done) * sizeof(glm::mat4);
+      for (int i=0; i<4; i++)
+      {
+        glVertexAttribPointer(POOL_TRANS_ATTRIB + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), 
+                              (void*)(base + i * sizeof(glm::vec4)));
+      }
+
+      unsigned int index_type = core.render.pools[pool].index_type;
+      glDrawElementsInstancedBaseVertex(GL_TRIANGLES, c.count, index_type, 
+                                        (void*)(c.first_index * indexSize(index_type)), 
+                                        last - first, c.base_vertex);
+
+      // the rest of this command goes with the next chunk
+      if (last < (size_t)c.base_instance + c.instance_count) break;
+      next++;
+    }
+    done += count;
+  }
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glUseProgram(core.render.bound_shader.id);
+  draws.clear();
+}
+
+void flushBatch(RenderPacket& packet)
+{
+  if (packet.cubes.empty() && packet.spheres.empty() && packet.lines.empty()) return;
+
+  // batch not initialized
   if (cube.indices_count == 0)
   {
-    initCube();
+    initBatch();
   }
-  glBindVertexArray(cube.vao);
-  glDrawElements(GL_TRIANGLES, cube.indices_count, GL_UNSIGNED_INT, 0);
+
+  glUseProgram(batch_shader.id);
+
+  if (!packet.cubes.empty()) flushInstances(cube, packet.cubes);
+  if (!packet.spheres.empty()) flushInstances(sphere, packet.spheres);
+  if (!packet.lines.empty()) flushLines(packet.lines);
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glUseProgram(core.render.bound_shader.id);
+
+  packet.cubes.clear();
+  packet.spheres.clear();
+  packet.lines.clear();
 }
 
+// set from the simulation thread, uniforms apply to the draws recorded after them
 void shaderSet(Shader shader, const std::string& name, bool b)
 {
+  if (deferUniform(shader, [=] { shaderSet(shader, name, b); })) return;
   glUniform1i(glGetUniformLocation(shader.id, name.c_str()), (int)b);
 }
 
 void shaderSet(Shader shader, const std::string& name, int i)
 {
+  if (deferUniform(shader, [=] { shaderSet(shader, name, i); })) return;
   glUniform1i(glGetUniformLocation(shader.id, name.c_str()), i);
 }
 
 void shaderSet(Shader shader, const std::string& name, float f)
 {
+  if (deferUniform(shader, [=] { shaderSet(shader, name, f); })) return;
   glUniform1f(glGetUniformLocation(shader.id, name.c_str()), f);
 }
 
 void shaderSet(Shader shader, const std::string& name, glm::vec2 v2)
 {
+  if (deferUniform(shader, [=] { shaderSet(shader, name, v2); })) return;
   glUniform2f(glGetUniformLocation(shader.id, name.c_str()), v2.x, v2.y);
 }
 
 void shaderSet(Shader shader, const std::string& name, glm::vec3 v3)
 {
+  if (deferUniform(shader, [=] { shaderSet(shader, name, v3); })) return;
   glUniform3f(glGetUniformLocation(shader.id, name.c_str()), v3.x, v3.y, v3.z);
 }
 
 void shaderSet(Shader shader, const std::string &name, Color c)
 {
+  if (deferUniform(shader, [=] { shaderSet(shader, name, c); })) return;
   glUniform4f(glGetUniformLocation(shader.id, name.c_str()), c.r, c.g, c.b, c.a);
 }
 
 void shaderSet(Shader shader, const std::string &name, glm::mat4 m)
 {
+  if (deferUniform(shader, [=] { shaderSet(shader, name, m); })) return;
   glUniformMatrix4fv(glGetUniformLocation(shader.id, name.c_str()), 1, GL_FALSE, &m[0][0]);
 }
 
 void shaderUse(Shader shader)
 {
+  core.render.current_shader = shader;
+  if (!onRenderThread()) return;
+  core.render.bound_shader = shader;
   glUseProgram(shader.id);
 }
 
+void uploadFrameData(const FrameData& frame)
+{
+  if (!onRenderThread())
+  {
+    simPacket().frame = frame;
+    simPacket().has_frame = true;
+    return;
+  }
+
+  // frame buffer not initialized
+  if (core.render.frame_alignment == 0)
+  {
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &core.render.frame_alignment);
+    core.render.frame_buffer = createDynamicBuffer(16 * 1024);
+  }
+
+  size_t offset;
+  if (!pushDynamicBuffer(core.render.frame_buffer, &frame, sizeof(FrameData), 
+                         offset, core.render.frame_alignment))
+  {
+    return;
+  }
+
+  glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_UBO_BINDING, core.render.frame_buffer.id, 
+                    offset, sizeof(FrameData));
+}
+
 }
\ No newline at end of file
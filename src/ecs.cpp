@@ -2,6 +2,24 @@
 
 #include <core.hpp>
 
+namespace mocha
+{
+void setTickRate(int hz)
+{
+  core.ecs.tick = 1.0/(double)hz;
+}
+
+float getFixedDT()
+{
+  return core.ecs.tick;
+}
+
+float getAlpha()
+{
+  return core.ecs.alpha;
+}
+}
+
 namespace mocha::ecs
 {
 
@@ -25,13 +43,57 @@ void remove(Entity e)
 void addSystem(System *sys)
 {
   core.ecs.systems.push_back(sys);
+  core.ecs.system_names.push_back(typeName(typeid(*sys)));
+}
+
+void addFixedSystem(System *sys)
+{
+  core.ecs.fixed_systems.push_back(sys);
+  core.ecs.fixed_system_names.push_back(typeName(typeid(*sys)));
+}
+
+// commands applied here reach the fixed steps of the same frame
+void addInputSystem(System *sys)
+{
+  core.ecs.input_systems.push_back(sys);
+  core.ecs.input_system_names.push_back(typeName(typeid(*sys)));
 }
 
 void update()
 {
-  for (System* s : core.ecs.systems)
+  for (size_t i=0; i<core.ecs.input_systems.size(); i++)
+  {
+    MOCHA_ZONE(core.ecs.input_system_names[i])
+    core.ecs.input_systems[i]->update();
+  }
+
+  // fixed steps for the time that passed, capped so a slow frame can not snowball
+  core.ecs.accumulator = std::min(core.ecs.accumulator + getDT(), core.ecs.tick * MAX_FIXED_STEPS);
+  while (core.ecs.accumulator >= core.ecs.tick)
+  {
+    for (size_t i=0; i<core.ecs.fixed_systems.size(); i++)
+    {
+      MOCHA_ZONE(core.ecs.fixed_system_names[i])
+      core.ecs.fixed_systems[i]->update();
+    }
+    core.ecs.accumulator -= core.ecs.tick;
+  }
+  core.ecs.alpha = core.ecs.accumulator / core.ecs.tick;
+
+  for (size_t i=0; i<core.ecs.systems.size(); i++)
+  {
+    MOCHA_ZONE(core.ecs.system_names[i])
+    core.ecs.systems[i]->update();
+  }
+
+  // once everything moved, drawing only reads the flat list
+  {
+    MOCHA_ZONE("extract")
+    extractRenderList();
+  }
   {
-    s->update();
+    MOCHA_ZONE("submit")
+    submitRenderList();
   }
 }
 
@@ -46,4 +46,26 @@ std::vector<Entity> view()
 
 }
 
+namespace mocha
+{
+// lua userdata keeps a pointer into the set, fields are read and written in place
+template<typename Component>
+void luaComponent(const char* name, const std::vector<LuaField>& fields, void (*sync)(void* component))
+{
+  LuaComponent c;
+  c.name = name;
+  c.fields = fields;
+  c.get = [](Entity e) -> void* { return &ecs::getSet<Component>().get(e); };
+  c.has = [](Entity e) { return ecs::getSet<Component>().has(e); };
+  c.emplace = [](Entity e) { ecs::emplace<Component>(e, Component{}); };
+  c.version = []() { return ecs::getSet<Component>().getVersion(); };
+  c.version_address = []() { return ecs::getSet<Component>().getVersionAddress(); };
+  c.entities = []() -> const std::vector<Entity>& { return ecs::getSet<Component>().getEntities(); };
+  c.data = []() -> void* { return ecs::getSet<Component>().getComponents().data(); };
+  c.sync = sync;
+  c.size = sizeof(Component);
+  registerLuaComponent(c);
+}
+}
+
 #endif
\ No newline at end of file
@@ -4,11 +4,268 @@
 #include <utils.hpp>
 #include <core.hpp>
 
+namespace
+{
+const char RECORD_MAGIC[4] = {'M', 'O', 'C', 'R'};
+
+template<typename T>
+void writeValue(std::ofstream& file, T value)
+{
+  file.write((const char*)&value, sizeof(T));
+}
+
+template<typename T>
+bool readValue(std::ifstream& file, T& value)
+{
+  return (bool)file.read((char*)&value, sizeof(T));
+}
+
+// frame: delta, event count, then type, code, action, x and y per event
+void recordFrame()
+{
+  using namespace mocha;
+  auto& in = core.input;
+
+  writeValue<double>(in.record, core.window.delta);
+  writeValue<uint32_t>(in.record, in.frame_events.size());
+  for (const InputEvent& e : in.frame_events)
+  {
+    writeValue<uint8_t>(in.record, e.type);
+    writeValue<int32_t>(in.record, e.code);
+    writeValue<int32_t>(in.record, e.action);
+    writeValue<float>(in.record, e.x);
+    writeValue<float>(in.record, e.y);
+  }
+}
+
+void endReplay(mocha::LogLevel level, const std::string& message)
+{
+  using namespace mocha;
+  auto& in = core.input;
+  log(level, message);
+  in.replay.close();
+  in.replaying = false;
+  in.replay_done = true;
+}
+
+// replaces the live events and the frame delta with the next recorded frame,
+// a truncated or corrupt frame is dropped whole and ends the replay
+void replayFrame()
+{
+  using namespace mocha;
+  auto& in = core.input;
+  in.tail = in.head;
+
+  double delta;
+  uint32_t count;
+  if (!readValue(in.replay, delta) || !readValue(in.replay, count))
+  {
+    endReplay(LogLevel::INFO, "Input replay finished");
+    return;
+  }
+  if (count > INPUT_QUEUE_SIZE)
+  {
+    endReplay(LogLevel::ERROR, "Input replay corrupt, frame has " + std::to_string(count) + " events");
+    return;
+  }
+
+  for (uint32_t i=0; i<count; i++)
+  {
+    uint8_t type;
+    int32_t code, action;
+    float x, y;
+    if (!readValue(in.replay, type) || !readValue(in.replay, code) || !readValue(in.replay, action)
+    ||  !readValue(in.replay, x) || !readValue(in.replay, y))
+    {
+      in.head = in.tail;
+      endReplay(LogLevel::ERROR, "Input replay truncated");
+      return;
+    }
+    pushInputEvent({core.window.current, type, code, action, x, y});
+  }
+  core.window.delta = delta;
+}
+
+// gamepads have no callbacks, changes since the last frame are turned into events
+void pollGamepads()
+{
+  using namespace mocha;
+  double now = glfwGetTime();
+
+  for (int pad=0; pad<MAX_GAMEPADS; pad++)
+  {
+    GamepadData& data = core.input.gamepads[pad];
+    GLFWgamepadstate state;
+    bool connected = glfwJoystickIsGamepad(GLFW_JOYSTICK_1 + pad) 
+                  && glfwGetGamepadState(GLFW_JOYSTICK_1 + pad, &state);
+    if (connected != data.connected)
+    {
+      int action = connected ? GLFW_CONNECTED : GLFW_DISCONNECTED;
+      pushInputEvent({now, kInputGamepadConnection, pad * GAMEPAD_CODE_STRIDE, action, 0.0f, 0.0f});
+    }
+    if (!connected) continue;
+
+    for (int b=0; b<GAMEPAD_BUTTONS; b++)
+    {
+      if ((state.buttons[b] == GLFW_PRESS) != data.current_buttons[b])
+      {
+        pushInputEvent({now, kInputGamepadButton, pad * GAMEPAD_CODE_STRIDE + b, state.buttons[b], 0.0f, 0.0f});
+      }
+    }
+    for (int a=0; a<GAMEPAD_AXES; a++)
+    {
+      if (std::abs(state.axes[a] - data.axes[a]) > 0.0001f)
+      {
+        pushInputEvent({now, kInputGamepadAxis, pad * GAMEPAD_CODE_STRIDE + a, 0, state.axes[a], 0.0f});
+      }
+    }
+  }
+}
+
+void applyKey(const mocha::InputEvent& e)
+{
+  using namespace mocha;
+  auto& in = core.input;
+
+  int key = e.code;
+  if (key < 0 || key >= MAX_KEYS) return;
+  bool down = e.action == GLFW_PRESS;
+  if (!in.pressed_keys[key] && !in.released_keys[key]) in.changed_keys.push_back(key);
+
+  if (down && !in.current_key_states[key]) in.down_keys.push_back(key);
+  if (!down && in.current_key_states[key])
+  {
+    auto it = std::find(in.down_keys.begin(), in.down_keys.end(), key);
+    *it = in.down_keys.back();
+    in.down_keys.pop_back();
+  }
+
+  if (down) in.pressed_keys[key] = true;
+  else      in.released_keys[key] = true;
+  in.current_key_states[key] = down;
+}
+
+void applyMouse(const mocha::InputEvent& e)
+{
+  using namespace mocha;
+  auto& in = core.input;
+
+  if (e.type == kInputMouseButton && e.code >= 0 && e.code < MAX_MOUSE_BUTTONS)
+  {
+    bool down = e.action == GLFW_PRESS;
+    if (down) in.pressed_mouse_buttons[e.code] = true;
+    else      in.released_mouse_buttons[e.code] = true;
+    in.current_mouse_button_states[e.code] = down;
+  }
+  else if (e.type == kInputCursor)
+  {
+    // the first position only sets where deltas start from
+    glm::vec2 position = {e.x, e.y};
+    if (in.has_mouse_position) in.mouse_delta += position - in.mouse_position;
+    in.mouse_position = position;
+    in.has_mouse_position = true;
+  }
+  else if (e.type == kInputScroll)
+  {
+    in.scroll += glm::vec2(e.x, e.y);
+  }
+}
+
+void applyGamepad(const mocha::InputEvent& e)
+{
+  using namespace mocha;
+
+  int pad = e.code / GAMEPAD_CODE_STRIDE;
+  int index = e.code % GAMEPAD_CODE_STRIDE;
+  if (pad < 0 || pad >= MAX_GAMEPADS) return;
+  GamepadData& data = core.input.gamepads[pad];
+
+  // a pad starts from a clean state and nothing stays held after an unplug
+  if (e.type == kInputGamepadConnection)
+  {
+    data = {};
+    data.connected = e.action == GLFW_CONNECTED;
+  }
+  else if (e.type == kInputGamepadButton && index < GAMEPAD_BUTTONS)
+  {
+    bool down = e.action == GLFW_PRESS;
+    if (down) data.pressed_buttons[index] = true;
+    else      data.released_buttons[index] = true;
+    data.current_buttons[index] = down;
+  }
+  else if (e.type == kInputGamepadAxis && index < GAMEPAD_AXES)
+  {
+    data.axes[index] = e.x;
+  }
+}
+
+// roll every snapshot at the frame boundary
+void rollInput()
+{
+  using namespace mocha;
+  auto& in = core.input;
+
+  memcpy(in.previous_key_states, in.current_key_states, sizeof(in.current_key_states));
+  memset(in.pressed_keys, 0, sizeof(in.pressed_keys));
+  memset(in.released_keys, 0, sizeof(in.released_keys));
+  in.changed_keys.clear();
+
+  memcpy(in.previous_mouse_button_states, in.current_mouse_button_states, sizeof(in.current_mouse_button_states));
+  memset(in.pressed_mouse_buttons, 0, sizeof(in.pressed_mouse_buttons));
+  memset(in.released_mouse_buttons, 0, sizeof(in.released_mouse_buttons));
+  in.mouse_delta = {0.0f, 0.0f};
+  in.scroll = {0.0f, 0.0f};
+
+  for (GamepadData& pad : in.gamepads)
+  {
+    memcpy(pad.previous_buttons, pad.current_buttons, sizeof(pad.current_buttons));
+    memset(pad.pressed_buttons, 0, sizeof(pad.pressed_buttons));
+    memset(pad.released_buttons, 0, sizeof(pad.released_buttons));
+  }
+}
+
+// recording and replay both start from nothing held, so the replay sees the same state
+void resetInputState()
+{
+  using namespace mocha;
+  auto& in = core.input;
+
+  memset(in.current_key_states, 0, sizeof(in.current_key_states));
+  memset(in.previous_key_states, 0, sizeof(in.previous_key_states));
+  memset(in.pressed_keys, 0, sizeof(in.pressed_keys));
+  memset(in.released_keys, 0, sizeof(in.released_keys));
+  in.changed_keys.clear();
+  in.down_keys.clear();
+
+  memset(in.current_mouse_button_states, 0, sizeof(in.current_mouse_button_states));
+  memset(in.previous_mouse_button_states, 0, sizeof(in.previous_mouse_button_states));
+  memset(in.pressed_mouse_buttons, 0, sizeof(in.pressed_mouse_buttons));
+  memset(in.released_mouse_buttons, 0, sizeof(in.released_mouse_buttons));
+  in.mouse_position = {0.0f, 0.0f};
+  in.mouse_delta = {0.0f, 0.0f};
+  in.scroll = {0.0f, 0.0f};
+  in.has_mouse_position = false;
+
+  // the next poll reconnects the pads, so their state is in the recording
+  for (GamepadData& pad : in.gamepads) pad = {};
+}
+
+bool validPad(int pad, int index, int count)
+{
+  return pad >= 0 && pad < MAX_GAMEPADS && index >= 0 && index < count;
+}
+
+bool validButton(int button)
+{
+  return button >= 0 && button < MAX_MOUSE_BUTTONS;
+}
+}
+
 namespace mocha 
 {
 bool checkKeyOutOfBounds(int key)
 {
-  if (key > MAX_KEYS)
+  if (key < 0 || key >= MAX_KEYS)
   {
     log(LogLevel::ERROR, "Key out of bounds!");
     return false;
@@ -18,28 +275,26 @@ bool checkKeyOutOfBounds(int key)
 
 bool getKeyPressed(int key)
 {
-  return  core.input.current_key_states[key] 
-  &&      !core.input.previous_key_states[key] 
-  &&      checkKeyOutOfBounds(key);
+  return  checkKeyOutOfBounds(key)
+  &&      core.input.pressed_keys[key];
 }
 
 bool getKeyDown(int key)
 {
-  return  core.input.current_key_states[key]
-  &&      checkKeyOutOfBounds(key);
+  return  checkKeyOutOfBounds(key)
+  &&      core.input.current_key_states[key];
 }
 
 bool getKeyReleased(int key)
 {
-  return  !core.input.current_key_states[key]
-  &&      core.input.previous_key_states[key]
-  &&      checkKeyOutOfBounds(key);
+  return  checkKeyOutOfBounds(key)
+  &&      core.input.released_keys[key];
 }
 
 bool getKeyUp(int key)
 {
-  return  !core.input.current_key_states[key]
-  &&      checkKeyOutOfBounds(key);
+  return  checkKeyOutOfBounds(key)
+  &&      !core.input.current_key_states[key];
 }
 
 KeyState getKeyState(int key)
@@ -50,4 +305,177 @@ KeyState getKeyState(int key)
   return KeyState::kUp;
 }
 
+bool getMouseButtonPressed(int button)
+{
+  return validButton(button) && core.input.pressed_mouse_buttons[button];
+}
+
+bool getMouseButtonDown(int button)
+{
+  return validButton(button) && core.input.current_mouse_button_states[button];
+}
+
+bool getMouseButtonReleased(int button)
+{
+  return validButton(button) && core.input.released_mouse_buttons[button];
+}
+
+bool getMouseButtonUp(int button)
+{
+  return validButton(button) && !core.input.current_mouse_button_states[button];
+}
+
+glm::vec2 getMousePosition()
+{
+  return core.input.mouse_position;
+}
+
+// movement since the last frame, summed over all cursor events
+glm::vec2 getMouseDelta()
+{
+  return core.input.mouse_delta;
+}
+
+glm::vec2 getMouseScroll()
+{
+  return core.input.scroll;
+}
+
+// unscaled and unaccelerated motion, only used while the cursor is disabled
+void setRawMouseMotion(bool enabled)
+{
+  if (core.window.headless || !glfwRawMouseMotionSupported()) return;
+  glfwSetInputMode(core.window.glfw_window, GLFW_RAW_MOUSE_MOTION, enabled ? GLFW_TRUE : GLFW_FALSE);
+}
+
+bool isGamepadConnected(int pad)
+{
+  return validPad(pad, 0, 1) && core.input.gamepads[pad].connected;
+}
+
+float getGamepadAxis(int pad, int axis)
+{
+  return validPad(pad, axis, GAMEPAD_AXES) ? core.input.gamepads[pad].axes[axis] : 0.0f;
+}
+
+bool getGamepadButtonPressed(int pad, int button)
+{
+  return validPad(pad, button, GAMEPAD_BUTTONS) && core.input.gamepads[pad].pressed_buttons[button];
+}
+
+bool getGamepadButtonDown(int pad, int button)
+{
+  return validPad(pad, button, GAMEPAD_BUTTONS) && core.input.gamepads[pad].current_buttons[button];
+}
+
+bool getGamepadButtonReleased(int pad, int button)
+{
+  return validPad(pad, button, GAMEPAD_BUTTONS) && core.input.gamepads[pad].released_buttons[button];
+}
+
+// called from the glfw callbacks, the oldest events are kept when full
+void pushInputEvent(const InputEvent& event)
+{
+  auto& in = core.input;
+  if (in.head - in.tail >= INPUT_QUEUE_SIZE)
+  {
+    in.dropped++;
+    return;
+  }
+  in.events[in.head % INPUT_QUEUE_SIZE] = event;
+  in.head++;
+}
+
+// roll the snapshots at the frame boundary, then apply the frame's events in order
+void drainInput()
+{
+  auto& in = core.input;
+  if (in.replaying) replayFrame();
+  else              pollGamepads();
+  rollInput();
+
+  in.frame_events.clear();
+  for (; in.tail != in.head; in.tail++)
+  {
+    const InputEvent& e = in.events[in.tail % INPUT_QUEUE_SIZE];
+    if (in.recording) in.frame_events.push_back(e);
+
+    switch (e.type)
+    {
+      case kInputKey:               applyKey(e); break;
+      case kInputMouseButton:
+      case kInputCursor:
+      case kInputScroll:            applyMouse(e); break;
+      case kInputGamepadButton:
+      case kInputGamepadAxis:
+      case kInputGamepadConnection: applyGamepad(e); break;
+    }
+  }
+
+  if (in.dropped > 0)
+  {
+    log(LogLevel::WARNING, "Input queue full, dropped " + std::to_string(in.dropped) + " events!");
+    in.dropped = 0;
+  }
+
+  if (in.recording) recordFrame();
+}
+
+// every drained event and frame delta from now on, see replayFrame for the layout
+bool startInputRecording(const std::string& path)
+{
+  auto& in = core.input;
+  stopInputRecording();
+
+  in.record.open(path, std::ios::binary);
+  if (!in.record.is_open())
+  {
+    log(LogLevel::ERROR, "Failed to write: " + path);
+    return false;
+  }
+
+  in.record.write(RECORD_MAGIC, sizeof(RECORD_MAGIC));
+  writeValue<uint32_t>(in.record, INPUT_RECORD_VERSION);
+  in.recording = true;
+  resetInputState();
+  return true;
+}
+
+void stopInputRecording()
+{
+  if (!core.input.recording) return;
+  core.input.record.close();
+  core.input.recording = false;
+}
+
+// live input is ignored and getDT returns the recorded deltas, so the simulation repeats exactly
+bool startInputReplay(const std::string& path)
+{
+  auto& in = core.input;
+  in.replay.close();
+  in.replay.clear();
+  in.replay.open(path, std::ios::binary);
+
+  char magic[4];
+  uint32_t version = 0;
+  if (!in.replay.is_open() || !in.replay.read(magic, sizeof(magic)) 
+  ||  memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0 || !readValue(in.replay, version) 
+  ||  version != INPUT_RECORD_VERSION)
+  {
+    log(LogLevel::ERROR, "Not an input recording: " + path);
+    in.replay.close();
+    return false;
+  }
+
+  in.replaying = true;
+  in.replay_done = false;
+  resetInputState();
+  return true;
+}
+
+bool isReplaying()
+{
+  return core.input.replaying;
+}
+
 }
\ No newline at end of file
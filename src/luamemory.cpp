@@ -0,0 +1,196 @@
+#define MOCHA_LUA_MEMORY
+
+#include <mocha.hpp>
+#include <utils.hpp>
+#include <core.hpp>
+
+namespace
+{
+// lua objects are mostly small, anything above the last class goes to malloc
+const size_t SIZE_CLASSES[LUA_SIZE_CLASSES] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+
+int sizeClass(size_t size)
+{
+  for (int i=0; i<LUA_SIZE_CLASSES; i++)
+  {
+    if (size <= SIZE_CLASSES[i]) return i;
+  }
+  return -1;
+}
+
+void* poolAlloc(mocha::LuaArena& arena, int c)
+{
+  if (arena.free_lists[c])
+  {
+    void* block = arena.free_lists[c];
+    arena.free_lists[c] = *(void**)block;
+    return block;
+  }
+
+  // carve from the current page, the tail of a full page is left unused
+  size_t size = SIZE_CLASSES[c];
+  if (arena.page_left < size)
+  {
+    char* page = (char*)malloc(LUA_PAGE_SIZE);
+    if (!page) return nullptr;
+    arena.pages.push_back(page);
+    arena.cursor = page;
+    arena.page_left = LUA_PAGE_SIZE;
+    arena.stats.pooled += LUA_PAGE_SIZE;
+  }
+
+  void* block = arena.cursor;
+  arena.cursor += size;
+  arena.page_left -= size;
+  return block;
+}
+
+void release(mocha::LuaArena& arena, void* block, size_t size)
+{
+  int c = sizeClass(size);
+  if (c < 0)
+  {
+    free(block);
+    arena.stats.large -= size;
+    return;
+  }
+  *(void**)block = arena.free_lists[c];
+  arena.free_lists[c] = block;
+}
+}
+
+namespace mocha
+{
+// lua_Alloc over LuaArena, lua always passes the real old size when ptr is set
+void* luaAlloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+  LuaArena& arena = *(LuaArena*)ud;
+  LuaMemoryStats& stats = arena.stats;
+  size_t old = ptr ? osize : 0;
+
+  if (nsize == 0)
+  {
+    if (ptr)
+    {
+      release(arena, ptr, old);
+      stats.used -= old;
+    }
+    return NULL;
+  }
+
+  // refused growth makes lua run an emergency collection and retry
+  if (stats.limit && nsize > old && stats.used + (nsize - old) > stats.limit)
+  {
+    stats.failed++;
+    return NULL;
+  }
+
+  int old_class = ptr ? sizeClass(old) : -1;
+  int new_class = sizeClass(nsize);
+  void* block;
+
+  if (ptr && old_class >= 0 && old_class == new_class)
+  {
+    block = ptr;
+  }
+  else if (ptr && old_class < 0 && new_class < 0)
+  {
+    block = realloc(ptr, nsize);
+    if (!block) return nsize <= old ? ptr : NULL;
+    stats.large += nsize - old;
+  }
+  else {
+    block = new_class >= 0 ? poolAlloc(arena, new_class) : malloc(nsize);
+    if (block)
+    {
+      if (new_class < 0) stats.large += nsize;
+      if (ptr)
+      {
+        memcpy(block, ptr, std::min(old, nsize));
+        release(arena, ptr, old);
+      }
+    }
+    else if (nsize > old)
+    {
+      return NULL;
+    }
+    else {
+      // lua expects shrinking to never fail, the old block is big enough and is later
+      // released into the new class, a malloc'd one becomes pool memory freed with the pages
+      block = ptr;
+      if (old_class < 0)
+      {
+        arena.pages.push_back((char*)ptr);
+        stats.large -= old;
+        stats.pooled += old;
+      }
+    }
+  }
+
+  if (!ptr) stats.allocations++;
+  stats.used += nsize - old;
+  stats.peak = std::max(stats.peak, stats.used);
+  return block;
+}
+
+void freeLuaArena()
+{
+  LuaArena& arena = core.lua.memory;
+  for (char* page : arena.pages) free(page);
+
+  size_t limit = arena.stats.limit;
+  arena = {};
+  arena.stats.limit = limit;
+}
+
+void setLuaMemoryLimit(size_t bytes)
+{
+  core.lua.memory.stats.limit = bytes;
+}
+
+// zeros keep the current lua values
+void setLuaGC(LuaGCMode mode, int a, int b, int c)
+{
+  lua_State* L = core.lua.state;
+  if (!L) return;
+
+  if (mode == kLuaGCGenerational)
+  {
+    lua_gc(L, LUA_GCGEN, a, b);
+  } else {
+    lua_gc(L, LUA_GCINC, a, b, c);
+  }
+}
+
+// collect in small steps every frame instead of whenever lua allocates
+void setLuaGCBudget(double ms)
+{
+  core.lua.gc_budget = ms;
+
+  lua_State* L = core.lua.state;
+  if (!L) return;
+  lua_gc(L, ms > 0.0 ? LUA_GCSTOP : LUA_GCRESTART);
+}
+
+LuaMemoryStats getLuaMemoryStats()
+{
+  return core.lua.memory.stats;
+}
+
+// called once per frame, steps until the budget is used or a cycle is done
+void stepLuaGC()
+{
+  lua_State* L = core.lua.state;
+  if (!L || core.lua.gc_budget <= 0.0) return;
+
+  MOCHA_ZONE("lua gc")
+  uint64_t start = profilerNow();
+  uint64_t budget = core.lua.gc_budget * 1000000.0;
+  while (profilerNow() - start < budget)
+  {
+    if (lua_gc(L, LUA_GCSTEP, 0)) break;
+  }
+  core.lua.memory.stats.gc_ms = (profilerNow() - start) / 1000000.0;
+}
+
+}
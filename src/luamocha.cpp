@@ -3,16 +3,921 @@
 #include <mocha.hpp>
 #include <utils.hpp>
 #include <core.hpp>
+#include <ecs.tpp>
+
+#include <filesystem>
+
+#ifdef LINUX
+  #include <sys/inotify.h>
+  #include <unistd.h>
+#endif
+
+namespace
+{
+const char* REF_META = "mocha.component";
+const char* COLUMN_META = "mocha.column";
+
+// userdata handed to lua, points into the component set until it changes
+struct ComponentRef {
+  void*         ptr;
+  mocha::Entity entity;
+  size_t        version;
+  int           type;
+};
+
+// one component type of the entities a batch system matched this frame
+struct LuaColumn {
+  int                type;
+  size_t             version;
+  const size_t*      set_version;   // checked on every access, cheaper than LuaComponent::version
+  const char*        last_key;      // pinned in the box's user value so its address is not reused
+  const mocha::LuaField* last_field;
+  std::vector<char*> rows;
+  const std::vector<mocha::Entity>* entities;
+};
+
+// remembers the script that added it, so a reload can replace it
+class ScriptSystem : public mocha::System
+{
+ public:
+  std::string script;
+  virtual ~ScriptSystem() {}
+};
+
+class LuaSystem : public ScriptSystem
+{
+ public:
+  LuaSystem(int r, bool f) : ref(r), fixed(f) {}
+  ~LuaSystem();
+  void update();
+
+ private:
+  int  ref;
+  bool fixed;
+};
+
+// gets whole columns in a single call instead of being called per entity
+class LuaBatchSystem : public ScriptSystem
+{
+ public:
+  LuaBatchSystem(int r, bool f, const std::vector<int>& types);
+  ~LuaBatchSystem();
+  void update();
+
+ private:
+  int  ref;
+  bool fixed;
+  std::vector<mocha::Entity> entities;
+  std::vector<LuaColumn>     columns;
+  std::vector<int>           column_refs;
+  void gather();
+};
+
+int panic(lua_State* L)
+{
+  mocha::log(mocha::LogLevel::FATAL, "Lua panic: " + std::string(lua_tostring(L, -1)));
+  return 0;
+}
+
+int traceback(lua_State* L)
+{
+  luaL_traceback(L, L, lua_tostring(L, 1), 1);
+  return 1;
+}
+
+// calls the function on top of the stack, errors are logged and popped
+bool protectedCall(lua_State* L, int args)
+{
+  int base = lua_gettop(L) - args;
+  lua_pushcfunction(L, traceback);
+  lua_insert(L, base);
+
+  mocha::luaProfileBegin();
+  bool ok = lua_pcall(L, args, 0, base) == LUA_OK;
+  mocha::luaProfileEnd();
+  if (!ok)
+  {
+    mocha::log(mocha::LogLevel::ERROR, lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+  lua_remove(L, base);
+  return ok;
+}
+
+int checkType(lua_State* L, int arg)
+{
+  const char* name = luaL_checkstring(L, arg);
+  const auto& components = mocha::core.lua.components;
+  for (size_t i=0; i<components.size(); i++)
+  {
+    if (strcmp(components[i].name, name) == 0) return i;
+  }
+  return luaL_error(L, "unknown component '%s'", name);
+}
+
+mocha::Entity checkEntity(lua_State* L, int arg)
+{
+  return (mocha::Entity)luaL_checkinteger(L, arg);
+}
+
+void* resolve(lua_State* L, ComponentRef* ref)
+{
+  const mocha::LuaComponent& c = mocha::core.lua.components[ref->type];
+  size_t version = c.version();
+  if (version != ref->version)
+  {
+    if (!c.has(ref->entity))
+    {
+      luaL_error(L, "entity %d has no %s anymore", (int)ref->entity, c.name);
+    }
+    ref->ptr = c.get(ref->entity);
+    ref->version = version;
+  }
+  return ref->ptr;
+}
+
+void pushRef(lua_State* L, int type, mocha::Entity e)
+{
+  const mocha::LuaComponent& c = mocha::core.lua.components[type];
+  ComponentRef* ref = (ComponentRef*)lua_newuserdatauv(L, sizeof(ComponentRef), 0);
+  *ref = {c.get(e), e, c.version(), type};
+  luaL_setmetatable(L, REF_META);
+}
+
+const mocha::LuaField& checkField(lua_State* L, int type, int arg)
+{
+  const mocha::LuaComponent& c = mocha::core.lua.components[type];
+  const char* key = luaL_checkstring(L, arg);
+  for (const mocha::LuaField& f : c.fields)
+  {
+    if (strcmp(f.name, key) == 0) return f;
+  }
+  luaL_error(L, "%s has no field '%s'", c.name, key);
+  return c.fields[0];
+}
+
+// vec3 fields are copied into {x, y, z} tables
+void pushVec3(lua_State* L, glm::vec3 v)
+{
+  lua_createtable(L, 0, 3);
+  lua_pushnumber(L, v.x); lua_setfield(L, -2, "x");
+  lua_pushnumber(L, v.y); lua_setfield(L, -2, "y");
+  lua_pushnumber(L, v.z); lua_setfield(L, -2, "z");
+}
+
+glm::vec3 checkVec3(lua_State* L, int arg)
+{
+  luaL_checktype(L, arg, LUA_TTABLE);
+  glm::vec3 v;
+  const char* names[3] = {"x", "y", "z"};
+  for (int i=0; i<3; i++)
+  {
+    if (lua_getfield(L, arg, names[i]) == LUA_TNIL)
+    {
+      lua_pop(L, 1);
+      lua_rawgeti(L, arg, i+1);
+    }
+    v[i] = luaL_checknumber(L, -1);
+    lua_pop(L, 1);
+  }
+  return v;
+}
+
+int refIndex(lua_State* L)
+{
+  ComponentRef* ref = (ComponentRef*)luaL_checkudata(L, 1, REF_META);
+  const mocha::LuaField& f = checkField(L, ref->type, 2);
+  char* data = (char*)resolve(L, ref) + f.offset;
+
+  switch (f.type)
+  {
+    case mocha::kLuaFloat: lua_pushnumber(L, *(float*)data); break;
+    case mocha::kLuaInt:   lua_pushinteger(L, *(int*)data); break;
+    case mocha::kLuaBool:  lua_pushboolean(L, *(bool*)data); break;
+    case mocha::kLuaVec3:  pushVec3(L, *(glm::vec3*)data); break;
+  }
+  return 1;
+}
+
+int refNewIndex(lua_State* L)
+{
+  ComponentRef* ref = (ComponentRef*)luaL_checkudata(L, 1, REF_META);
+  const mocha::LuaField& f = checkField(L, ref->type, 2);
+  char* data = (char*)resolve(L, ref) + f.offset;
+
+  switch (f.type)
+  {
+    case mocha::kLuaFloat: *(float*)data = luaL_checknumber(L, 3); break;
+    case mocha::kLuaInt:   *(int*)data = luaL_checkinteger(L, 3); break;
+    case mocha::kLuaBool:  *(bool*)data = lua_toboolean(L, 3); break;
+    case mocha::kLuaVec3:  *(glm::vec3*)data = checkVec3(L, 3); break;
+  }
+
+  const mocha::LuaComponent& c = mocha::core.lua.components[ref->type];
+  if (c.sync) c.sync(data - f.offset);
+  return 0;
+}
+
+int refToString(lua_State* L)
+{
+  ComponentRef* ref = (ComponentRef*)luaL_checkudata(L, 1, REF_META);
+  lua_pushfstring(L, "%s(%d)", mocha::core.lua.components[ref->type].name, (int)ref->entity);
+  return 1;
+}
+
+// the box is cleared when its system is removed, scripts may still hold on to it
+LuaColumn* checkBox(lua_State* L, int arg)
+{
+  LuaColumn* column = *(LuaColumn**)luaL_checkudata(L, arg, COLUMN_META);
+  if (!column) luaL_error(L, "column of a removed batch system");
+  return column;
+}
+
+LuaColumn* checkColumn(lua_State* L, int arg)
+{
+  LuaColumn* column = checkBox(L, arg);
+  if (*column->set_version != column->version)
+  {
+    luaL_error(L, "%s storage changed during the batch", mocha::core.lua.components[column->type].name);
+  }
+  return column;
+}
+
+char* checkRow(lua_State* L, LuaColumn* column, int arg)
+{
+  lua_Integer i = luaL_checkinteger(L, arg);
+  luaL_argcheck(L, i >= 1 && i <= (lua_Integer)column->rows.size(), arg, "row out of range");
+  return column->rows[i-1];
+}
+
+// batch loops ask for the same field every row, only a new key string is looked up by name
+const mocha::LuaField& columnField(lua_State* L, LuaColumn* column, int arg)
+{
+  const char* key = luaL_checkstring(L, arg);
+  if (key == column->last_key) return *column->last_field;
+
+  column->last_field = &checkField(L, column->type, arg);
+  column->last_key = key;
+  lua_pushvalue(L, arg);
+  lua_setiuservalue(L, 1, 1);
+  return *column->last_field;
+}
+
+// column:get(i, "field") -> value, vec3 fields return x, y, z
+int columnGet(lua_State* L)
+{
+  LuaColumn* column = checkColumn(L, 1);
+  char* row = checkRow(L, column, 2);
+  const mocha::LuaField& f = columnField(L, column, 3);
+  char* data = row + f.offset;
+
+  switch (f.type)
+  {
+    case mocha::kLuaFloat: lua_pushnumber(L, *(float*)data); return 1;
+    case mocha::kLuaInt:   lua_pushinteger(L, *(int*)data); return 1;
+    case mocha::kLuaBool:  lua_pushboolean(L, *(bool*)data); return 1;
+    case mocha::kLuaVec3:
+    {
+      glm::vec3 v = *(glm::vec3*)data;
+      lua_pushnumber(L, v.x);
+      lua_pushnumber(L, v.y);
+      lua_pushnumber(L, v.z);
+      return 3;
+    }
+  }
+  return 0;
+}
+
+// column:set(i, "field", value), vec3 fields take x, y, z
+int columnSet(lua_State* L)
+{
+  LuaColumn* column = checkColumn(L, 1);
+  char* row = checkRow(L, column, 2);
+  const mocha::LuaField& f = columnField(L, column, 3);
+  char* data = row + f.offset;
+
+  switch (f.type)
+  {
+    case mocha::kLuaFloat: *(float*)data = luaL_checknumber(L, 4); break;
+    case mocha::kLuaInt:   *(int*)data = luaL_checkinteger(L, 4); break;
+    case mocha::kLuaBool:  *(bool*)data = lua_toboolean(L, 4); break;
+    case mocha::kLuaVec3:
+      *(glm::vec3*)data = {luaL_checknumber(L, 4), luaL_checknumber(L, 5), luaL_checknumber(L, 6)};
+      break;
+  }
+
+  const mocha::LuaComponent& c = mocha::core.lua.components[column->type];
+  if (c.sync) c.sync(row);
+  return 0;
+}
+
+// column:entity(i) -> entity
+int columnEntity(lua_State* L)
+{
+  LuaColumn* column = checkColumn(L, 1);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, i >= 1 && i <= (lua_Integer)column->rows.size(), 2, "row out of range");
+  lua_pushinteger(L, (*column->entities)[i-1]);
+  return 1;
+}
+
+int columnLen(lua_State* L)
+{
+  LuaColumn* column = checkBox(L, 1);
+  lua_pushinteger(L, column->rows.size());
+  return 1;
+}
+
+// mocha.create() -> entity
+int luaCreate(lua_State* L)
+{
+  lua_pushinteger(L, mocha::ecs::create());
+  return 1;
+}
+
+// mocha.remove(entity)
+int luaRemove(lua_State* L)
+{
+  mocha::ecs::remove(checkEntity(L, 1));
+  return 0;
+}
+
+// mocha.get(entity, "Component") -> component or nil
+int luaGet(lua_State* L)
+{
+  mocha::Entity e = checkEntity(L, 1);
+  int type = checkType(L, 2);
+  if (!mocha::core.lua.components[type].has(e))
+  {
+    lua_pushnil(L);
+    return 1;
+  }
+  pushRef(L, type, e);
+  return 1;
+}
+
+// mocha.add(entity, "Component") -> component, zero initialized if new
+int luaAdd(lua_State* L)
+{
+  mocha::Entity e = checkEntity(L, 1);
+  int type = checkType(L, 2);
+  mocha::core.lua.components[type].emplace(e);
+  pushRef(L, type, e);
+  return 1;
+}
+
+// mocha.has(entity, "Component") -> bool
+int luaHas(lua_State* L)
+{
+  mocha::Entity e = checkEntity(L, 1);
+  lua_pushboolean(L, mocha::core.lua.components[checkType(L, 2)].has(e));
+  return 1;
+}
+
+// mocha.view("Component", ...) -> array of entities with all of them
+int luaView(lua_State* L)
+{
+  int count = lua_gettop(L);
+  std::vector<int> types;
+  for (int i=1; i<=count; i++) types.push_back(checkType(L, i));
+  if (types.empty()) return luaL_error(L, "view needs at least one component");
+
+  const auto& components = mocha::core.lua.components;
+  const std::vector<mocha::Entity>& base = components[types[0]].entities();
+
+  lua_createtable(L, base.size(), 0);
+  int n = 0;
+  for (mocha::Entity e : base)
+  {
+    bool match = true;
+    for (size_t i=1; i<types.size() && match; i++) match = components[types[i]].has(e);
+    if (!match) continue;
+
+    lua_pushinteger(L, e);
+    lua_rawseti(L, -2, ++n);
+  }
+  return 1;
+}
+
+std::string functionName(lua_State* L, int arg)
+{
+  lua_Debug ar;
+  lua_pushvalue(L, arg);
+  lua_getinfo(L, ">S", &ar);
+  return "lua " + std::string(ar.short_src) + ":" + std::to_string(ar.linedefined);
+}
+
+// named after the function so scripts show up in traces
+void addNamedSystem(ScriptSystem* sys, bool fixed, const std::string& name)
+{
+  sys->script = mocha::core.lua.current_script;
+  if (fixed)
+  {
+    mocha::ecs::addFixedSystem(sys);
+    mocha::core.ecs.fixed_system_names.back() = mocha::internName(name);
+  } else {
+    mocha::ecs::addSystem(sys);
+    mocha::core.ecs.system_names.back() = mocha::internName(name);
+  }
+}
+
+void addLuaSystem(lua_State* L, bool fixed)
+{
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  std::string name = functionName(L, 1);
+
+  lua_pushvalue(L, 1);
+  addNamedSystem(new LuaSystem(luaL_ref(L, LUA_REGISTRYINDEX), fixed), fixed, name);
+}
+
+void addLuaBatchSystem(lua_State* L, bool fixed)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+
+  std::vector<int> types;
+  int count = luaL_len(L, 1);
+  for (int i=1; i<=count; i++)
+  {
+    lua_rawgeti(L, 1, i);
+    types.push_back(checkType(L, -1));
+    lua_pop(L, 1);
+  }
+  if (types.empty()) luaL_error(L, "batch system needs at least one component");
+
+  std::string name = functionName(L, 2);
+  lua_pushvalue(L, 2);
+  addNamedSystem(new LuaBatchSystem(luaL_ref(L, LUA_REGISTRYINDEX), fixed, types), fixed, name);
+}
+
+// mocha.addSystem(function(dt) end)
+int luaAddSystem(lua_State* L)
+{
+  addLuaSystem(L, false);
+  return 0;
+}
+
+// mocha.addFixedSystem(function(dt) end), runs at the tick rate
+int luaAddFixedSystem(lua_State* L)
+{
+  addLuaSystem(L, true);
+  return 0;
+}
+
+// mocha.addBatchSystem({"Component", ...}, function(count, dt, column, ...) end)
+int luaAddBatchSystem(lua_State* L)
+{
+  addLuaBatchSystem(L, false);
+  return 0;
+}
+
+int luaAddFixedBatchSystem(lua_State* L)
+{
+  addLuaBatchSystem(L, true);
+  return 0;
+}
+
+int luaLog(lua_State* L)
+{
+  mocha::log(mocha::LogLevel::INFO, luaL_tolstring(L, 1, NULL));
+  return 0;
+}
+
+int luaDT(lua_State* L)
+{
+  lua_pushnumber(L, mocha::getDT());
+  return 1;
+}
+
+// drop the systems a script added, its functions are about to be replaced
+void removeScriptSystems(std::vector<mocha::System*>& systems, std::vector<const char*>& names, 
+                         const std::string& script)
+{
+  for (size_t i=0; i<systems.size();)
+  {
+    ScriptSystem* sys = dynamic_cast<ScriptSystem*>(systems[i]);
+    if (sys && sys->script == script)
+    {
+      delete sys;
+      systems.erase(systems.begin() + i);
+      names.erase(names.begin() + i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void setReloading(lua_State* L, bool reloading)
+{
+  lua_getglobal(L, "mocha");
+  lua_pushboolean(L, reloading);
+  lua_setfield(L, -2, "reloading");
+  lua_pop(L, 1);
+}
+
+// fnv-1a, seeded with the lua version so bytecode of another version never matches
+uint64_t hashSource(const std::string& source, uint64_t hash = 14695981039346656037ull ^ LUA_VERSION_NUM)
+{
+  for (unsigned char c : source)
+  {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+int dumpWriter(lua_State* L, const void* p, size_t size, void* out)
+{
+  ((std::string*)out)->append((const char*)p, size);
+  return 0;
+}
+
+// the key of the chunk goes in front of its bytecode
+void writeBytecode(lua_State* L, const std::string& path, uint64_t key)
+{
+  std::string bytecode((const char*)&key, sizeof(key));
+  lua_dump(L, dumpWriter, &bytecode, 0);
+
+  std::error_code error;
+  std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+  std::ofstream file(path, std::ios::binary);
+  if (!file.is_open())
+  {
+    mocha::log(mocha::LogLevel::WARNING, "Failed to write: " + path);
+    return;
+  }
+  file.write(bytecode.data(), bytecode.size());
+}
+
+// loads the chunk onto the stack, logs and returns false on syntax errors
+// compiled chunks are cached one file per script, keyed by chunkname and source hash,
+// so unchanged scripts skip the parser and an edit overwrites the stale bytecode
+bool loadScript(lua_State* L, const std::string& path)
+{
+  using namespace mocha;
+
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+  {
+    log(LogLevel::ERROR, "Failed to open: " + path);
+    return false;
+  }
+  std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::string name = "@" + path;
+  forgetLuaSources();
+
+  // the chunkname is compiled into the bytecode, it is part of the key
+  uint64_t key = hashSource(source, hashSource(name));
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)hashSource(path));
+  std::string cache_path = std::string(core.assets.cache) + "scripts/" + hash + ".luac";
+
+  std::ifstream cached(cache_path, std::ios::binary);
+  if (cached.is_open())
+  {
+    std::string bytecode((std::istreambuf_iterator<char>(cached)), std::istreambuf_iterator<char>());
+    cached.close();
+    uint64_t cached_key = 0;
+    if (bytecode.size() > sizeof(key)) memcpy(&cached_key, bytecode.data(), sizeof(key));
+    if (cached_key == key)
+    {
+      if (luaL_loadbufferx(L, bytecode.data() + sizeof(key), bytecode.size() - sizeof(key), name.c_str(), "b") == LUA_OK)
+      {
+        core.lua.cache_hits++;
+        return true;
+      }
+      log(LogLevel::WARNING, "Bad bytecode cache: " + cache_path);
+      lua_pop(L, 1);
+    }
+  }
+
+  if (luaL_loadbufferx(L, source.data(), source.size(), name.c_str(), "t") != LUA_OK)
+  {
+    log(LogLevel::ERROR, lua_tostring(L, -1));
+    lua_pop(L, 1);
+    return false;
+  }
+  core.lua.cache_misses++;
+  writeBytecode(L, cache_path, key);
+  return true;
+}
+
+bool callScript(lua_State* L, const std::string& path)
+{
+  mocha::core.lua.current_script = path;
+  bool ok = protectedCall(L, 0);
+  mocha::core.lua.current_script.clear();
+  return ok;
+}
+
+// changed scripts since the last poll, inotify on linux, write times elsewhere
+std::vector<std::string> changedScripts()
+{
+  using namespace mocha;
+  std::vector<std::string> changed;
+
+  #ifdef LINUX
+    alignas(inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(core.lua.watch_fd, buffer, sizeof(buffer))) > 0)
+    {
+      for (char* p = buffer; p < buffer + length;)
+      {
+        inotify_event* event = (inotify_event*)p;
+        std::string name = event->len ? event->name : "";
+        if (name.size() > 4 && name.ends_with(".lua")) changed.push_back(core.assets.scripts + name);
+        p += sizeof(inotify_event) + event->len;
+      }
+    }
+  #else
+    if (core.window.current - core.lua.poll_time < 0.5) return changed;
+    core.lua.poll_time = core.window.current;
+
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(core.assets.scripts, error))
+    {
+      if (entry.path().extension() != ".lua") continue;
+      int64_t time = entry.last_write_time(error).time_since_epoch().count();
+      auto [it, added] = core.lua.write_times.try_emplace(entry.path().string(), time);
+      if (!added && it->second != time)
+      {
+        it->second = time;
+        changed.push_back(entry.path().string());
+      }
+    }
+  #endif
+
+  std::sort(changed.begin(), changed.end());
+  changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+  return changed;
+}
+
+LuaSystem::~LuaSystem()
+{
+  if (mocha::core.lua.state) luaL_unref(mocha::core.lua.state, LUA_REGISTRYINDEX, ref);
+}
+
+LuaBatchSystem::~LuaBatchSystem()
+{
+  lua_State* L = mocha::core.lua.state;
+  if (!L) return;
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  for (int column_ref : column_refs)
+  {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, column_ref);
+    *(LuaColumn**)lua_touserdata(L, -1) = nullptr;
+    lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, column_ref);
+  }
+}
+
+void LuaSystem::update()
+{
+  lua_State* L = mocha::core.lua.state;
+  if (!L) return;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  lua_pushnumber(L, fixed ? mocha::getFixedDT() : mocha::getDT());
+  protectedCall(L, 1);
+}
+
+// column userdata only box a pointer, they are created once and refilled every frame
+LuaBatchSystem::LuaBatchSystem(int r, bool f, const std::vector<int>& types) : ref(r), fixed(f)
+{
+  lua_State* L = mocha::core.lua.state;
+  columns.resize(types.size());
+  for (size_t i=0; i<types.size(); i++)
+  {
+    columns[i].type = types[i];
+    columns[i].entities = &entities;
+    columns[i].set_version = mocha::core.lua.components[types[i]].version_address();
+
+    LuaColumn** box = (LuaColumn**)lua_newuserdatauv(L, sizeof(LuaColumn*), 1);
+    *box = &columns[i];
+    luaL_setmetatable(L, COLUMN_META);
+    column_refs.push_back(luaL_ref(L, LUA_REGISTRYINDEX));
+  }
+}
+
+// entities of the first component that have all the others
+void LuaBatchSystem::gather()
+{
+  const auto& components = mocha::core.lua.components;
+  const mocha::LuaComponent& base = components[columns[0].type];
+  const std::vector<mocha::Entity>& base_entities = base.entities();
+  char* base_data = (char*)base.data();
+
+  entities.clear();
+  for (LuaColumn& column : columns)
+  {
+    column.rows.clear();
+    column.version = *column.set_version;
+  }
+
+  for (size_t i=0; i<base_entities.size(); i++)
+  {
+    mocha::Entity e = base_entities[i];
+    bool match = true;
+    for (size_t c=1; c<columns.size() && match; c++) match = components[columns[c].type].has(e);
+    if (!match) continue;
+
+    entities.push_back(e);
+    columns[0].rows.push_back(base_data + i * base.size);
+    for (size_t c=1; c<columns.size(); c++)
+    {
+      columns[c].rows.push_back((char*)components[columns[c].type].get(e));
+    }
+  }
+}
+
+void LuaBatchSystem::update()
+{
+  lua_State* L = mocha::core.lua.state;
+  if (!L) return;
+
+  gather();
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  lua_pushinteger(L, entities.size());
+  lua_pushnumber(L, fixed ? mocha::getFixedDT() : mocha::getDT());
+  for (int column_ref : column_refs) lua_rawgeti(L, LUA_REGISTRYINDEX, column_ref);
+  protectedCall(L, 2 + column_refs.size());
+}
+}
 
 namespace mocha
 {
+void registerLuaComponent(const LuaComponent& component)
+{
+  core.lua.components.push_back(component);
+}
+
 void luaBindings()
 {
-  
+  lua_State* L = lua_newstate(luaAlloc, &core.lua.memory);
+  lua_atpanic(L, panic);
+  luaL_openlibs(L);
+  core.lua.state = L;
+  if (core.lua.gc_budget > 0.0) lua_gc(L, LUA_GCSTOP);
+  applyLuaProfiler();
+
+  luaL_newmetatable(L, REF_META);
+  const luaL_Reg ref_funcs[] = {
+    {"__index",    refIndex},
+    {"__newindex", refNewIndex},
+    {"__tostring", refToString},
+    {NULL, NULL}
+  };
+  luaL_setfuncs(L, ref_funcs, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, COLUMN_META);
+  const luaL_Reg column_funcs[] = {
+    {"get",    columnGet},
+    {"set",    columnSet},
+    {"entity", columnEntity},
+    {NULL, NULL}
+  };
+  luaL_newlib(L, column_funcs);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, columnLen);
+  lua_setfield(L, -2, "__len");
+  lua_pop(L, 1);
+
+  const luaL_Reg funcs[] = {
+    {"create",         luaCreate},
+    {"remove",         luaRemove},
+    {"get",            luaGet},
+    {"add",            luaAdd},
+    {"has",            luaHas},
+    {"view",           luaView},
+    {"addSystem",      luaAddSystem},
+    {"addFixedSystem", luaAddFixedSystem},
+    {"addBatchSystem", luaAddBatchSystem},
+    {"addFixedBatchSystem", luaAddFixedBatchSystem},
+    {"log",            luaLog},
+    {"dt",             luaDT},
+    {NULL, NULL}
+  };
+  luaL_newlib(L, funcs);
+  lua_setglobal(L, "mocha");
+
+  // engine components, rendering reads the translation of trans
+  luaComponent<ecs::Position>("Position", {
+    MOCHA_LUA_FIELD(ecs::Position, pos, kLuaVec3),
+  }, [](void* component) {
+    ecs::Position& p = *(ecs::Position*)component;
+    p.trans[3] = glm::vec4(p.pos, 1.0f);
+  });
+  luaComponent<ecs::Physics>("Physics", {
+    MOCHA_LUA_FIELD(ecs::Physics, speed, kLuaFloat),
+    MOCHA_LUA_FIELD(ecs::Physics, velocity, kLuaVec3),
+  });
+  luaComponent<ecs::Camera3D>("Camera", {
+    MOCHA_LUA_FIELD(ecs::Camera3D, speed, kLuaFloat),
+    MOCHA_LUA_FIELD(ecs::Camera3D, sens, kLuaFloat),
+    MOCHA_LUA_FIELD(ecs::Camera3D, zoom, kLuaFloat),
+  });
+}
+
+bool runScript(const std::string& path)
+{
+  MOCHA_ZONE("runScript")
+  lua_State* L = core.lua.state;
+  if (!loadScript(L, path)) return false;
+  return callScript(L, path);
+}
+
+// reruns the script in the same state, the ecs world and lua globals are kept
+// mocha.reloading is true while it runs so one time setup can be skipped
+bool reloadScript(const std::string& path)
+{
+  MOCHA_ZONE("reloadScript")
+  lua_State* L = core.lua.state;
+
+  // a script that does not compile keeps its old systems
+  if (!loadScript(L, path)) return false;
+
+  removeScriptSystems(core.ecs.systems, core.ecs.system_names, path);
+  removeScriptSystems(core.ecs.fixed_systems, core.ecs.fixed_system_names, path);
+
+  setReloading(L, true);
+  bool ok = callScript(L, path);
+  setReloading(L, false);
+
+  log(LogLevel::INFO, "Reloaded " + path);
+  return ok;
+}
+
+void setScriptReload(bool enabled)
+{
+  if (enabled == core.lua.reload) return;
+
+  #ifdef LINUX
+    if (enabled)
+    {
+      core.lua.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (core.lua.watch_fd < 0 
+      ||  inotify_add_watch(core.lua.watch_fd, core.assets.scripts, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+      {
+        log(LogLevel::WARNING, "Failed to watch: " + std::string(core.assets.scripts));
+        if (core.lua.watch_fd >= 0) close(core.lua.watch_fd);
+        return;
+      }
+    } else {
+      close(core.lua.watch_fd);
+    }
+  #else
+    // first poll only records the current write times
+    core.lua.write_times.clear();
+    core.lua.poll_time = 0.0;
+    if (enabled) changedScripts();
+  #endif
+
+  core.lua.reload = enabled;
+}
+
+// called once per frame, outside of system updates
+void pollScripts()
+{
+  if (!core.lua.reload || !core.lua.state) return;
+
+  for (const std::string& path : changedScripts())
+  {
+    reloadScript(path);
+  }
 }
 
+// every script in the scripts folder, in name order
 void runScripts()
 {
+  std::vector<std::string> paths;
+  std::error_code error;
+  for (const auto& entry : std::filesystem::directory_iterator(core.assets.scripts, error))
+  {
+    if (entry.path().extension() == ".lua") paths.push_back(entry.path().string());
+  }
+  if (error) log(LogLevel::WARNING, "No scripts folder: " + std::string(core.assets.scripts));
+
+  std::sort(paths.begin(), paths.end());
+  for (const std::string& path : paths)
+  {
+    runScript(path);
+  }
+
+  log(LogLevel::DEBUG, "Scripts: " + std::to_string(core.lua.cache_hits) + " cached, " 
+                       + std::to_string(core.lua.cache_misses) + " compiled");
+}
 
+void closeLua()
+{
+  setScriptReload(false);
+  if (!core.lua.state) return;
+  lua_close(core.lua.state);
+  core.lua.state = nullptr;
+
+  LuaMemoryStats stats = getLuaMemoryStats();
+  log(LogLevel::INFO, "Lua memory peak " + std::to_string(stats.peak / 1024) + "KB, " 
+                      + std::to_string(stats.failed) + " allocations over the limit");
+  freeLuaArena();
+}
 }
-}
\ No newline at end of file
@@ -3,13 +3,7 @@
 
 // Main file, will be used to for main loop and running lua scripts
 #include <mocha.hpp>
-
-
-struct Position 
-{
-  glm::vec3 pos;
-  glm::mat4 trans;
-};
+#include <ecs.tpp>
 
 int main()
 {
@@ -18,8 +12,10 @@ int main()
   mocha::Shader s = mocha::loadShader("default");
   mocha::Model m = mocha::loadModel("cube");
   auto e = mocha::ecs::create();
-  mocha::ecs::emplace<Position>(e, {{0, 0, 0}, glm::mat4(1)});
+  mocha::ecs::emplace<mocha::ecs::Position>(e, {{0, 0, 0}, glm::mat4(1)});
   mocha::shaderUse(s);
+  mocha::runScripts();
+  mocha::setScriptReload(true);
 
   MOCHA_LOOP_START
 
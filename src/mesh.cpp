@@ -0,0 +1,395 @@
+#define MOCHA_MESH
+
+#include <mocha.hpp>
+#include <utils.hpp>
+#include <core.hpp>
+
+namespace
+{
+// symmetric 4x4 error quadric of a plane ax + by + cz + d = 0
+struct Quadric {
+  double aa, ab, ac, ad;
+  double     bb, bc, bd;
+  double         cc, cd;
+  double             dd;
+};
+
+Quadric planeQuadric(glm::dvec3 n, double d, double w)
+{
+  return {
+    w*n.x*n.x, w*n.x*n.y, w*n.x*n.z, w*n.x*d,
+               w*n.y*n.y, w*n.y*n.z, w*n.y*d,
+                          w*n.z*n.z, w*n.z*d,
+                                     w*d*d
+  };
+}
+
+void addQuadric(Quadric& q, const Quadric& o)
+{
+  q.aa += o.aa; q.ab += o.ab; q.ac += o.ac; q.ad += o.ad;
+  q.bb += o.bb; q.bc += o.bc; q.bd += o.bd;
+  q.cc += o.cc; q.cd += o.cd;
+  q.dd += o.dd;
+}
+
+double quadricError(const Quadric& q, glm::vec3 p)
+{
+  double x = p.x, y = p.y, z = p.z;
+  return q.aa*x*x + 2*q.ab*x*y + 2*q.ac*x*z + 2*q.ad*x
+       + q.bb*y*y + 2*q.bc*y*z + 2*q.bd*y
+       + q.cc*z*z + 2*q.cd*z
+       + q.dd;
+}
+
+struct Collapse {
+  unsigned int from;
+  unsigned int to;
+  double       cost;
+};
+
+// key a position by its bits so vertices split on uv/normal seams are found
+struct PositionHash {
+  size_t operator()(const glm::vec3& p) const
+  {
+    unsigned int h[3];
+    memcpy(h, &p, sizeof(h));
+    return (h[0] * 73856093u) ^ (h[1] * 19349663u) ^ (h[2] * 83492791u);
+  }
+};
+
+// map a unit vector onto the octahedron and unfold it into [-1, 1]^2
+glm::vec2 octEncode(glm::vec3 n)
+{
+  n /= std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+  glm::vec2 e(n.x, n.y);
+  if (n.z < 0.0f)
+  {
+    e = (1.0f - glm::abs(glm::vec2(n.y, n.x))) 
+      * glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+  }
+  return e;
+}
+
+// next fanning vertex for tipsify, prefers vertices that are still in the cache
+int nextFanVertex(const std::vector<unsigned int>& candidates, const std::vector<int>& live,
+                  const std::vector<int>& stamps, int time, int cache_size,
+                  std::vector<unsigned int>& dead_ends, size_t& cursor)
+{
+  int best = -1, best_priority = -1;
+  for (unsigned int v : candidates)
+  {
+    if (live[v] <= 0) continue;
+
+    // still in cache after fanning it, the older the better
+    int priority = 0;
+    if (time - stamps[v] + 2 * live[v] <= cache_size) priority = time - stamps[v];
+
+    if (priority > best_priority)
+    {
+      best_priority = priority;
+      best = v;
+    }
+  }
+  if (best >= 0) return best;
+
+  // dead end, fall back to recently used vertices then to input order
+  while (!dead_ends.empty())
+  {
+    unsigned int v = dead_ends.back();
+    dead_ends.pop_back();
+    if (live[v] > 0) return v;
+  }
+  while (cursor < live.size())
+  {
+    if (live[cursor] > 0) return cursor;
+    cursor++;
+  }
+  return -1;
+}
+
+// true if moving `from` onto `to` turns any remaining triangle around
+bool collapseFlips(const std::vector<mocha::Vertex>& vertices, const std::vector<unsigned int>& indices,
+                   const std::vector<unsigned int>& triangles, unsigned int from, unsigned int to)
+{
+  for (unsigned int t : triangles)
+  {
+    const unsigned int* tri = &indices[t*3];
+    if (tri[0] == to || tri[1] == to || tri[2] == to) continue;
+
+    glm::vec3 p[3], q[3];
+    for (int i=0; i<3; i++)
+    {
+      p[i] = vertices[tri[i]].position;
+      q[i] = tri[i] == from ? vertices[to].position : p[i];
+    }
+
+    glm::vec3 before = glm::cross(p[1]-p[0], p[2]-p[0]);
+    glm::vec3 after  = glm::cross(q[1]-q[0], q[2]-q[0]);
+    if (glm::dot(before, after) <= 0.0f) return true;
+  }
+  return false;
+}
+}
+
+namespace mocha
+{
+// Quadric edge collapse (Garland & Heckbert) that keeps the vertex buffer and only rewrites
+// indices, so all levels of detail can share one vertex buffer. Vertices on uv/normal seams
+// and open borders are locked to keep the mesh closed.
+std::vector<unsigned int> simplifyMesh(const std::vector<Vertex>& vertices,
+                                       const std::vector<unsigned int>& indices, size_t target_count)
+{
+  size_t vertex_count = vertices.size();
+  std::vector<unsigned int> out = indices;
+
+  // lock seams
+  std::vector<bool> locked(vertex_count, false);
+  std::unordered_map<glm::vec3, unsigned int, PositionHash> positions;
+  for (unsigned int v=0; v<vertex_count; v++)
+  {
+    auto [it, inserted] = positions.insert({vertices[v].position, v});
+    if (!inserted)
+    {
+      locked[v] = true;
+      locked[it->second] = true;
+    }
+  }
+
+  // lock borders, an edge used by only one triangle
+  std::map<std::pair<unsigned int, unsigned int>, int> edge_use;
+  for (size_t i=0; i<out.size(); i+=3)
+  {
+    for (int e=0; e<3; e++)
+    {
+      unsigned int a = out[i+e], b = out[i+(e+1)%3];
+      edge_use[{std::min(a, b), std::max(a, b)}]++;
+    }
+  }
+  for (const auto& [edge, uses] : edge_use)
+  {
+    if (uses == 1) locked[edge.first] = locked[edge.second] = true;
+  }
+
+  // area weighted plane quadrics
+  std::vector<Quadric> quadrics(vertex_count, Quadric{});
+  for (size_t i=0; i<out.size(); i+=3)
+  {
+    glm::dvec3 p0 = vertices[out[i]].position;
+    glm::dvec3 p1 = vertices[out[i+1]].position;
+    glm::dvec3 p2 = vertices[out[i+2]].position;
+
+    glm::dvec3 n = glm::cross(p1-p0, p2-p0);
+    double area = glm::length(n);
+    if (area == 0.0) continue;
+    n /= area;
+
+    Quadric q = planeQuadric(n, -glm::dot(n, p0), area);
+    for (int k=0; k<3; k++) addQuadric(quadrics[out[i+k]], q);
+  }
+
+  std::vector<std::vector<unsigned int>> adjacency(vertex_count);
+  std::vector<Collapse> collapses;
+  std::vector<unsigned int> remap(vertex_count);
+  std::vector<bool> touched(vertex_count);
+
+  while (out.size() > target_count)
+  {
+    for (auto& a : adjacency) a.clear();
+    for (size_t t=0; t<out.size()/3; t++)
+    {
+      for (int k=0; k<3; k++) adjacency[out[t*3+k]].push_back(t);
+    }
+
+    // cheapest direction of every collapsible edge
+    collapses.clear();
+    for (size_t i=0; i<out.size(); i+=3)
+    {
+      for (int e=0; e<3; e++)
+      {
+        unsigned int a = out[i+e], b = out[i+(e+1)%3];
+        if (a > b) continue;
+        if (locked[a] && locked[b]) continue;
+
+        Quadric q = quadrics[a];
+        addQuadric(q, quadrics[b]);
+
+        double cost_ab = locked[a] ? DBL_MAX : quadricError(q, vertices[b].position);
+        double cost_ba = locked[b] ? DBL_MAX : quadricError(q, vertices[a].position);
+
+        if (cost_ab <= cost_ba) collapses.push_back({a, b, cost_ab});
+        else                    collapses.push_back({b, a, cost_ba});
+      }
+    }
+
+    std::sort(collapses.begin(), collapses.end(), [](const Collapse& x, const Collapse& y) {
+      return x.cost < y.cost;
+    });
+
+    // each collapse removes about two triangles
+    size_t wanted = (out.size() - target_count) / 3 / 2 + 1;
+    size_t done = 0;
+
+    for (unsigned int v=0; v<vertex_count; v++) remap[v] = v;
+    std::fill(touched.begin(), touched.end(), false);
+
+    for (const Collapse& c : collapses)
+    {
+      if (done >= wanted) break;
+      if (touched[c.from] || touched[c.to]) continue;
+      if (collapseFlips(vertices, out, adjacency[c.from], c.from, c.to)) continue;
+
+      remap[c.from] = c.to;
+      addQuadric(quadrics[c.to], quadrics[c.from]);
+      touched[c.from] = touched[c.to] = true;
+      done++;
+    }
+
+    if (done == 0) break;
+
+    size_t write = 0;
+    for (size_t i=0; i<out.size(); i+=3)
+    {
+      unsigned int a = remap[out[i]], b = remap[out[i+1]], c = remap[out[i+2]];
+      if (a == b || b == c || a == c) continue;
+      out[write++] = a;
+      out[write++] = b;
+      out[write++] = c;
+    }
+    out.resize(write);
+  }
+
+  return out;
+}
+
+std::vector<PackedVertex> packVertices(const std::vector<Vertex>& vertices, glm::vec3 min, glm::vec3 max)
+{
+  glm::vec3 extent = glm::max(max - min, glm::vec3(FLT_MIN));
+  std::vector<PackedVertex> out(vertices.size());
+
+  for (size_t i=0; i<vertices.size(); i++)
+  {
+    const Vertex& v = vertices[i];
+    PackedVertex& p = out[i];
+
+    glm::vec3 q = glm::clamp((v.position - min) / extent, 0.0f, 1.0f);
+    for (int k=0; k<3; k++) p.position[k] = glm::packUnorm1x16(q[k]);
+    p.position[3] = 0;
+
+    p.tex_coord[0] = glm::packHalf1x16(v.tex_coord.x);
+    p.tex_coord[1] = glm::packHalf1x16(v.tex_coord.y);
+
+    glm::vec2 n = glm::length(v.normal) > 0.0f ? octEncode(glm::normalize(v.normal)) : glm::vec2(0.0f);
+    p.normal[0] = (short)glm::packSnorm1x16(n.x);
+    p.normal[1] = (short)glm::packSnorm1x16(n.y);
+  }
+
+  return out;
+}
+
+glm::mat4 getDecodeTransform(const Model& m)
+{
+  if (m.format != kVertexPacked) return glm::mat4(1.0f);
+  return glm::scale(glm::translate(glm::mat4(1.0f), m.quant_offset), m.quant_scale);
+}
+
+// Tipsify (Sander et al.) reorders triangles for a post-transform cache of cache_size entries
+void optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertex_count, int cache_size)
+{
+  size_t triangle_count = indices.size() / 3;
+  if (triangle_count == 0) return;
+
+  std::vector<int> live(vertex_count, 0);
+  std::vector<std::vector<unsigned int>> adjacency(vertex_count);
+  for (size_t t=0; t<triangle_count; t++)
+  {
+    for (int k=0; k<3; k++)
+    {
+      live[indices[t*3+k]]++;
+      adjacency[indices[t*3+k]].push_back(t);
+    }
+  }
+
+  std::vector<int> stamps(vertex_count, 0);
+  std::vector<bool> emitted(triangle_count, false);
+  std::vector<unsigned int> dead_ends;
+  std::vector<unsigned int> candidates;
+  std::vector<unsigned int> out;
+  out.reserve(indices.size());
+
+  int time = cache_size + 1;
+  size_t cursor = 0;
+  int fan = indices[0];
+
+  while (fan >= 0)
+  {
+    candidates.clear();
+    for (unsigned int t : adjacency[fan])
+    {
+      if (emitted[t]) continue;
+      emitted[t] = true;
+
+      for (int k=0; k<3; k++)
+      {
+        unsigned int v = indices[t*3+k];
+        out.push_back(v);
+        dead_ends.push_back(v);
+        candidates.push_back(v);
+        live[v]--;
+
+        if (time - stamps[v] > cache_size)
+        {
+          stamps[v] = time;
+          time++;
+        }
+      }
+    }
+
+    fan = nextFanVertex(candidates, live, stamps, time, cache_size, dead_ends, cursor);
+  }
+
+  indices = std::move(out);
+}
+
+// renumber vertices in order of first use so vertex fetches are sequential
+void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices)
+{
+  const unsigned int unused = ~0u;
+  std::vector<unsigned int> remap(vertices.size(), unused);
+  std::vector<Vertex> out;
+  out.reserve(vertices.size());
+
+  for (unsigned int& i : indices)
+  {
+    if (remap[i] == unused)
+    {
+      remap[i] = out.size();
+      out.push_back(vertices[i]);
+    }
+    i = remap[i];
+  }
+
+  vertices = std::move(out);
+}
+
+// average cache miss ratio, transformed vertices per triangle with a fifo cache
+float getACMR(const std::vector<unsigned int>& indices, size_t vertex_count, int cache_size)
+{
+  if (indices.empty()) return 0.0f;
+
+  std::vector<size_t> stamps(vertex_count, 0);
+  size_t time = cache_size + 1;
+  size_t misses = 0;
+
+  for (unsigned int i : indices)
+  {
+    if (time - stamps[i] > (size_t)cache_size)
+    {
+      stamps[i] = time++;
+      misses++;
+    }
+  }
+
+  return (float)misses / (indices.size() / 3);
+}
+
+}
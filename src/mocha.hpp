@@ -5,6 +5,8 @@
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <cstring>
+#include <cfloat>
 #include <vector>
 #include <algorithm>
 #include <any>
@@ -12,12 +14,20 @@
 #include <map>
 #include <typeindex>
 #include <functional>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <unordered_set>
 
 #include <lua/lua.hpp>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/packing.hpp>
 
 #ifdef __linux__
   #define LINUX
@@ -27,6 +37,8 @@
   #define WINDOWS
 #endif
 
+#define MAX_LODS 4
+
 namespace mocha
 {
 
@@ -90,6 +102,28 @@ kDOWN = 264,
 kUP = 265,
 };
 
+enum FrameMode {
+  kFrameFixed = 0,  // sleep to setFPS
+  kFrameVsync,      // let the swap wait for the display
+  kFrameUncapped,
+};
+
+enum LuaGCMode {
+  kLuaGCIncremental = 0,  // pause, step multiplier, step size
+  kLuaGCGenerational,     // minor multiplier, major multiplier
+};
+
+enum ModelFlag {
+  kModelDefault    = 0,
+  kModelPooled     = 1 << 0, // share one vertex/index buffer with all pooled models
+  kModelCompressed = 1 << 1, // upload PackedVertex instead of Vertex
+};
+
+enum VertexFormat {
+  kVertexFloat = 0,
+  kVertexPacked,
+};
+
 enum KeyState {
   kPressed = 0,
   kDown,
@@ -97,6 +131,40 @@ enum KeyState {
   kUp,
 };
 
+enum MouseButton {
+  kMouseLeft = 0,
+  kMouseRight,
+  kMouseMiddle,
+};
+
+// same order as the glfw gamepad mapping
+enum GamepadButton {
+  kPadA = 0,
+  kPadB,
+  kPadX,
+  kPadY,
+  kPadLeftBumper,
+  kPadRightBumper,
+  kPadBack,
+  kPadStart,
+  kPadGuide,
+  kPadLeftThumb,
+  kPadRightThumb,
+  kPadUp,
+  kPadRight,
+  kPadDown,
+  kPadLeft,
+};
+
+enum GamepadAxis {
+  kPadLeftX = 0,
+  kPadLeftY,
+  kPadRightX,
+  kPadRightY,
+  kPadLeftTrigger,
+  kPadRightTrigger,
+};
+
 // STRUCTS
 struct Vertex {
   glm::vec3 position;
@@ -106,6 +174,13 @@ struct Vertex {
   bool operator==(const Vertex& other);
 };
 
+// 16 byte vertex: position quantized to the mesh bounds, half float uv, octahedral normal
+struct PackedVertex {
+  unsigned short position[4];
+  unsigned short tex_coord[2];
+  short          normal[2];
+};
+
 struct Color {
   unsigned char r;
   unsigned char g;
@@ -128,9 +203,67 @@ struct Shader {
   int id;
 };
 
-struct Model {
+struct Lod {
   int indices_count;
-  unsigned int vao;
+  int first_index;
+};
+
+struct Model {
+  int indices_count = 0;
+  unsigned int vao  = 0;
+  unsigned int index_type = GL_UNSIGNED_INT;
+
+  // location in a shared model pool
+  int first_index   = 0;
+  int base_vertex   = 0;
+  int pool          = -1;
+
+  // level of detail chain, lods[0] is the full mesh
+  Lod       lods[MAX_LODS] = {};
+  int       lod_count      = 1;
+  glm::vec3 center         = {0.0f, 0.0f, 0.0f};
+  float     radius         = 0.0f;
+
+  // vertex layout, packed positions decode to quant_offset + p * quant_scale
+  int       format         = kVertexFloat;
+  glm::vec3 quant_offset   = {0.0f, 0.0f, 0.0f};
+  glm::vec3 quant_scale    = {1.0f, 1.0f, 1.0f};
+};
+
+struct FrameStats {
+  double average_ms;
+  double min_ms;
+  double max_ms;
+  double jitter_ms;      // standard deviation of the frame time
+  double wake_error_ms;  // how late fixed rate frames started
+};
+
+struct LuaMemoryStats {
+  size_t used;         // bytes lua asked for
+  size_t peak;
+  size_t limit;        // 0 when unlimited
+  size_t pooled;       // bytes held in pool pages
+  size_t large;        // bytes allocated outside the pool
+  size_t allocations;
+  size_t failed;       // allocations refused by the limit
+  double gc_ms;        // collector time in the last frame
+};
+
+struct LuaFunctionTime {
+  const char* name;
+  size_t      samples;
+  double      ms;
+};
+
+struct ZoneTime {
+  const char* name;
+  double      ms;
+};
+
+// per frame streaming buffer, see buffers.cpp
+struct DynamicBuffer {
+  int          index;
+  unsigned int id;
 };
 
 struct Camera {
@@ -149,6 +282,20 @@ struct System {
   virtual void update() = 0;
 };
 
+// Component member exposed to lua, see luaComponent
+enum LuaFieldType {
+  kLuaFloat,
+  kLuaInt,
+  kLuaBool,
+  kLuaVec3,
+};
+
+struct LuaField {
+  const char*  name;
+  size_t       offset;
+  LuaFieldType type;
+};
+
 struct Command {
   std::function<void(Entity&)> use;
   Command(std::function<void(Entity&)> u) : use(u) {};
@@ -173,6 +320,7 @@ class ComponentSet : public IStorage
   void insert(Entity e, const Component& c)
   {
     if (has(e)) return;
+    version++;
     connection[e] = components.size();
     entities.push_back(e);
     components.push_back(c);
@@ -181,6 +329,7 @@ class ComponentSet : public IStorage
   void remove(Entity e)
   {
     if (!has(e)) return;
+    version++;
     int index = connection[e];
     int last = entities.size()-1;
 
@@ -204,7 +353,26 @@ class ComponentSet : public IStorage
     return entities;
   }
 
+  // dense components, same order as getEntities
+  std::vector<Component>& getComponents()
+  {
+    return components;
+  }
+
+  // changes whenever components move, pointers from get stay valid until then
+  size_t getVersion()
+  {
+    return version;
+  }
+
+  // stays valid for the lifetime of the set, for callers that check the version often
+  const size_t* getVersionAddress()
+  {
+    return &version;
+  }
+
  private:
+  size_t                          version = 0;
   std::vector<Entity>             entities;
   std::vector<Component>          components;
   std::unordered_map<Entity, int> connection;
@@ -252,10 +420,20 @@ namespace ecs
 {
 using Render   =  Model;
 using Camera3D =  Camera;
+struct Position {
+  glm::vec3 pos;
+  glm::mat4 trans = glm::mat4(1.0f);
+};
+// position before the last fixed step, added by PhysicsSys
+struct Interpolated {
+  glm::vec3 previous;
+};
 struct Physics {
   float     speed;
   glm::vec3 velocity;
 };
+// compiled into an action table when the set changes, emplacing again on an entity that
+// already has bindings or editing them in place is not seen, remove and emplace to change them
 using InputBindings = std::map<std::pair<int, KeyState>, Command*>;
 }
 
@@ -263,6 +441,7 @@ using InputBindings = std::map<std::pair<int, KeyState>, Command*>;
 
 // window
 void initWindow(int width, int height, const char* title);
+void initHeadless(int width, int height);
 void closeWindow();
 bool windowShouldClose();
 bool Begin();
@@ -270,13 +449,28 @@ void End();
 
 void  setFPS(int fps);
 int   getFPS();
+void  setFrameMode(FrameMode mode);
+FrameStats getFrameStats();
 float getDT();
+void  setMaxFrames(int frames);
+void  setTickRate(int hz);
+float getFixedDT();
+float getAlpha();
+bool  takeScreenshot(const std::string& path);
+bool  saveFrameTimes(const std::string& path);
+void  setPipelined(bool enabled);
 
 // drawing
 void clearColor(Color color);
 void drawModel(Model m);
 void drawModel(Model m, glm::mat4 trans);
+Model getLod(Model m, int lod);
+int   selectLod(const Model& m, glm::mat4 trans);
 void drawCube(glm::vec3 pos, glm::vec3 size, Color color);
+void drawSphere(glm::vec3 center, float radius, Color color);
+void drawLine(glm::vec3 start, glm::vec3 end, Color color);
+void drawBoundingBox(glm::vec3 min, glm::vec3 max, Color color);
+void drawGrid(int slices, float spacing);
 
 void shaderSet(Shader shader, const std::string& name, bool b);
 void shaderSet(Shader shader, const std::string& name, int i);
@@ -294,10 +488,75 @@ bool getKeyReleased(int key);
 bool getKeyUp(int key);
 KeyState getKeyState(int key);
 
+bool getMouseButtonPressed(int button);
+bool getMouseButtonDown(int button);
+bool getMouseButtonReleased(int button);
+bool getMouseButtonUp(int button);
+glm::vec2 getMousePosition();
+glm::vec2 getMouseDelta();
+glm::vec2 getMouseScroll();
+void  setRawMouseMotion(bool enabled);
+
+bool  isGamepadConnected(int pad);
+float getGamepadAxis(int pad, int axis);
+bool  getGamepadButtonPressed(int pad, int button);
+bool  getGamepadButtonDown(int pad, int button);
+bool  getGamepadButtonReleased(int pad, int button);
+
+bool startInputRecording(const std::string& path);
+void stopInputRecording();
+bool startInputReplay(const std::string& path);
+bool isReplaying();
+
+// mesh
+std::vector<unsigned int> simplifyMesh(const std::vector<Vertex>& vertices, 
+                                       const std::vector<unsigned int>& indices, size_t target_count);
+std::vector<PackedVertex> packVertices(const std::vector<Vertex>& vertices, glm::vec3 min, glm::vec3 max);
+glm::mat4                 getDecodeTransform(const Model& m);
+void  optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertex_count, int cache_size = 16);
+void  optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices);
+float getACMR(const std::vector<unsigned int>& indices, size_t vertex_count, int cache_size = 16);
+
+// buffers
+DynamicBuffer createDynamicBuffer(size_t size);
+void*         mapDynamicBuffer(DynamicBuffer buffer, size_t bytes, size_t& offset, size_t alignment = 16);
+void          unmapDynamicBuffer(DynamicBuffer buffer);
+bool          pushDynamicBuffer(DynamicBuffer buffer, const void* src, size_t bytes, size_t& offset, size_t alignment = 16);
+size_t        getDynamicBufferSpace(DynamicBuffer buffer, size_t alignment = 16);
+void          cycleDynamicBuffer(DynamicBuffer buffer);
+
+// profiler
+void   setGpuProfiler(bool enabled);
+void   setGpuOverlay(bool enabled);
+void   gpuZoneBegin(const char* name);
+void   gpuZoneEnd();
+double getGpuZoneTime(const char* name);
+const std::vector<ZoneTime>& getGpuZoneTimes();
+
+struct GpuZone {
+  GpuZone(const char* name) { gpuZoneBegin(name); }
+  ~GpuZone() { gpuZoneEnd(); }
+};
+
+void setProfiler(bool enabled);
+void clearTrace();
+bool saveTrace(const std::string& path);
+
+void setLuaProfiler(bool enabled, int instructions = 1000);
+void clearLuaProfile();
+std::vector<LuaFunctionTime> getLuaProfile();
+
+struct CpuZone {
+  const char* name;
+  uint64_t    start;
+  CpuZone(const char* n);
+  ~CpuZone();
+};
+
 // resources
 std::string loadFile(const std::string& path);
 Shader      loadShader(const std::string& name);
-Model       loadModel(const std::string& name);
+Model       loadModel(const std::string& name, int flags = kModelDefault);
 
 // ecs
 #define COMPONENT template<typename Component>
@@ -313,6 +572,8 @@ COMPONENTS std::vector<Entity> view();
           Entity create();
           void remove(Entity e);
           void addSystem(System *sys);
+          void addFixedSystem(System *sys);
+          void addInputSystem(System *sys);
           void update();
 }
 
@@ -320,6 +581,14 @@ COMPONENTS std::vector<Entity> view();
 // lua
 void luaBindings();
 void runScripts();
+bool runScript(const std::string& path);
+bool reloadScript(const std::string& path);
+void setScriptReload(bool enabled);
+void setLuaMemoryLimit(size_t bytes);
+void setLuaGC(LuaGCMode mode, int a = 0, int b = 0, int c = 0);
+void setLuaGCBudget(double ms);
+LuaMemoryStats getLuaMemoryStats();
+COMPONENT void luaComponent(const char* name, const std::vector<LuaField>& fields, void (*sync)(void* component) = nullptr);
 
 // const
 const Color BLACK   = {0, 0, 0, 255};
@@ -336,4 +605,10 @@ const Color WHITE   = {255, 255, 255, 255};
 #define MOCHA_SYSTEMS_UPDATE mocha::ecs::update();
 #define MOCHA_LOOP_END mocha::End();}
 
+#define MOCHA_CONCAT_(a, b) a##b
+#define MOCHA_CONCAT(a, b) MOCHA_CONCAT_(a, b)
+#define MOCHA_GPU_ZONE(name) mocha::GpuZone MOCHA_CONCAT(gpu_zone_, __LINE__)(name);
+#define MOCHA_LUA_FIELD(type, member, kind) mocha::LuaField{#member, offsetof(type, member), kind}
+#define MOCHA_ZONE(name) mocha::CpuZone MOCHA_CONCAT(cpu_zone_, __LINE__)(name);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,176 @@
+#define MOCHA_PIPELINE
+
+#include <mocha.hpp>
+#include <utils.hpp>
+#include <core.hpp>
+
+namespace
+{
+void renderPacket(mocha::RenderPacket& packet)
+{
+  using namespace mocha;
+  MOCHA_ZONE("render")
+
+  for (auto& task : packet.tasks) task();
+  packet.tasks.clear();
+
+  if (core.window.headless)
+  {
+    glBindFramebuffer(GL_FRAMEBUFFER, core.window.offscreen.fbo);
+  }
+
+  gpuZoneBegin("clear");
+  clearColor(BLACK);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  gpuZoneEnd();
+
+  if (packet.has_frame) uploadFrameData(packet.frame);
+  presentPacket(packet);
+}
+
+// owns the gl context while pipelined, draws packet N while the simulation builds N+1
+void renderLoop()
+{
+  using namespace mocha;
+  auto& pipe = core.pipeline;
+
+  glfwMakeContextCurrent(core.window.glfw_window);
+  {
+    std::lock_guard<std::mutex> lock(pipe.mutex);
+    pipe.render_id = std::this_thread::get_id();
+    pipe.started = true;
+  }
+  pipe.cv.notify_all();
+
+  std::vector<std::function<void()>> tasks;
+  while (true)
+  {
+    bool has_packet;
+    {
+      std::unique_lock<std::mutex> lock(pipe.mutex);
+      pipe.cv.wait(lock, [&] { return pipe.submitted || pipe.quit || !pipe.tasks.empty(); });
+      tasks.swap(pipe.tasks);
+      has_packet = pipe.submitted;
+      if (pipe.quit && !has_packet && tasks.empty()) break;
+    }
+
+    for (auto& task : tasks) task();
+    tasks.clear();
+
+    if (has_packet)
+    {
+      renderPacket(core.render.packets[pipe.render_packet]);
+      std::lock_guard<std::mutex> lock(pipe.mutex);
+      pipe.submitted = false;
+    }
+    pipe.cv.notify_all();
+  }
+
+  glFinish();
+  glfwMakeContextCurrent(NULL);
+}
+}
+
+namespace mocha
+{
+// events and simulation stay on the main thread, the context moves to a render thread
+void setPipelined(bool enabled)
+{
+  auto& pipe = core.pipeline;
+  if (enabled == pipe.enabled) return;
+
+  if (!enabled)
+  {
+    stopPipeline();
+    return;
+  }
+
+  glFinish();
+  glfwMakeContextCurrent(NULL);
+
+  pipe.quit = false;
+  pipe.submitted = false;
+  pipe.started = false;
+  pipe.enabled = true;
+  pipe.thread = std::thread(renderLoop);
+
+  // gl calls are only routed correctly once the render thread id is known
+  {
+    std::unique_lock<std::mutex> lock(pipe.mutex);
+    pipe.cv.wait(lock, [&] { return pipe.started; });
+  }
+  log(LogLevel::INFO, "Pipelined rendering enabled");
+}
+
+void stopPipeline()
+{
+  auto& pipe = core.pipeline;
+  if (!pipe.enabled) return;
+
+  {
+    std::lock_guard<std::mutex> lock(pipe.mutex);
+    pipe.quit = true;
+  }
+  pipe.cv.notify_all();
+  pipe.thread.join();
+
+  pipe.enabled = false;
+  pipe.render_id = std::thread::id();
+  glfwMakeContextCurrent(core.window.glfw_window);
+
+  // draws recorded since the last End are presented by the next one
+  for (auto& task : simPacket().tasks) task();
+  simPacket().tasks.clear();
+}
+
+// true when gl can be called directly
+bool onRenderThread()
+{
+  return !core.pipeline.enabled || std::this_thread::get_id() == core.pipeline.render_id;
+}
+
+// blocks until the render thread ran the task
+void runOnRenderThread(const std::function<void()>& task)
+{
+  if (onRenderThread())
+  {
+    task();
+    return;
+  }
+
+  auto& pipe = core.pipeline;
+  bool done = false;
+  std::unique_lock<std::mutex> lock(pipe.mutex);
+  pipe.tasks.push_back([&] {
+    task();
+    std::lock_guard<std::mutex> guard(pipe.mutex);
+    done = true;
+  });
+  pipe.cv.notify_all();
+  pipe.cv.wait(lock, [&] { return done; });
+}
+
+// queue the task in front of the current packet, false if it can run right away
+bool deferToRenderThread(const std::function<void()>& task)
+{
+  if (onRenderThread()) return false;
+  simPacket().tasks.push_back(task);
+  return true;
+}
+
+// hand the packet to the render thread, waits while the previous one is still drawing
+void submitPacket()
+{
+  auto& pipe = core.pipeline;
+  {
+    MOCHA_ZONE("wait render")
+    std::unique_lock<std::mutex> lock(pipe.mutex);
+    pipe.cv.wait(lock, [&] { return !pipe.submitted; });
+    pipe.render_packet = core.render.sim_packet;
+    core.render.sim_packet = 1 - core.render.sim_packet;
+    pipe.submitted = true;
+  }
+  pipe.cv.notify_all();
+}
+
+}
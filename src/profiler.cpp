@@ -0,0 +1,390 @@
+#define MOCHA_PROFILER
+
+#include <mocha.hpp>
+#include <utils.hpp>
+#include <core.hpp>
+
+#ifdef __GNUG__
+  #include <cxxabi.h>
+#endif
+
+namespace
+{
+// per thread event buffer, only its own thread appends to it
+thread_local mocha::ThreadTrace* thread_trace = nullptr;
+
+mocha::ThreadTrace* registerThread()
+{
+  using namespace mocha;
+
+  std::lock_guard<std::mutex> lock(core.profiler.threads_mutex);
+  ThreadTrace* trace = new ThreadTrace();
+  trace->tid = core.profiler.threads.size();
+  trace->events.reset(new CpuZoneEvent[CPU_TRACE_CAPACITY]);
+  core.profiler.threads.push_back(trace);
+  return trace;
+}
+
+void writeJsonString(std::ostream& out, const char* s)
+{
+  out << '"';
+  for (; *s; s++)
+  {
+    if (*s == '"' || *s == '\\') out << '\\';
+    out << *s;
+  }
+  out << '"';
+}
+
+// read back a finished frame, skipped if the gpu is not done with it yet
+void resolveGpuFrame(mocha::GpuFrame& frame)
+{
+  using namespace mocha;
+
+  if (frame.zones.empty()) return;
+
+  int available = 0;
+  glGetQueryObjectiv(frame.zones.back().end, GL_QUERY_RESULT_AVAILABLE, &available);
+  if (available)
+  {
+    core.profiler.gpu_results.clear();
+    for (const GpuZoneQuery& z : frame.zones)
+    {
+      GLuint64 begin, end;
+      glGetQueryObjectui64v(z.begin, GL_QUERY_RESULT, &begin);
+      glGetQueryObjectui64v(z.end, GL_QUERY_RESULT, &end);
+      core.profiler.gpu_results.push_back({z.name, (end - begin) / 1000000.0});
+    }
+  }
+
+  frame.zones.clear();
+  frame.used = 0;
+}
+
+unsigned int nextQuery(mocha::GpuFrame& frame)
+{
+  if (frame.used == frame.queries.size())
+  {
+    unsigned int q;
+    glGenQueries(1, &q);
+    frame.queries.push_back(q);
+  }
+  return frame.queries[frame.used++];
+}
+
+// only the first sample of a function builds and interns its name
+size_t lookupFunction(lua_State* L, lua_Debug* ar)
+{
+  using namespace mocha;
+  auto& prof = core.profiler;
+
+  std::pair<const char*, int> source = {ar->source, ar->linedefined};
+  if (source == prof.lua_last_source) return prof.lua_last_function;
+
+  auto it = prof.lua_sources.find(source);
+  if (it == prof.lua_sources.end())
+  {
+    lua_getinfo(L, "n", ar);
+    std::string key = ar->short_src + std::string(":") + std::to_string(ar->linedefined);
+    if (ar->name) key = std::string(ar->name) + " (" + key + ")";
+    else if (strcmp(ar->what, "main") == 0) key = "main chunk (" + std::string(ar->short_src) + ")";
+    const char* name = internName(key);
+
+    auto [named, added] = prof.lua_lookup.try_emplace(name, prof.lua_functions.size());
+    if (added) prof.lua_functions.push_back({name, 0, 0.0});
+    it = prof.lua_sources.emplace(source, named->second).first;
+  }
+
+  prof.lua_last_source = source;
+  prof.lua_last_function = it->second;
+  return it->second;
+}
+
+// count hook, the time since the previous sample goes to the running function
+void luaHook(lua_State* L, lua_Debug* ar)
+{
+  using namespace mocha;
+  auto& prof = core.profiler;
+
+  lua_getinfo(L, "S", ar);
+  LuaFunctionTime& f = prof.lua_functions[lookupFunction(L, ar)];
+  const char* name = f.name;
+
+  uint64_t now = profilerNow();
+  uint64_t previous = prof.lua_last;
+  prof.lua_last = now;
+
+  f.samples++;
+  f.ms += (now - previous) / 1000000.0;
+
+  // consecutive samples of one function become one zone in the trace
+  if (name != prof.lua_current)
+  {
+    if (prof.lua_current && prof.cpu_enabled) recordZone(prof.lua_current, prof.lua_run_start, previous);
+    prof.lua_current = name;
+    prof.lua_run_start = previous;
+  }
+}
+
+void updateOverlay()
+{
+  using namespace mocha;
+
+  if (core.window.current - core.profiler.overlay_time < 0.5) return;
+  core.profiler.overlay_time = core.window.current;
+
+  std::ostringstream title;
+  title.precision(2);
+  title << std::fixed << core.window.title << " |";
+  for (const ZoneTime& z : core.profiler.gpu_results)
+  {
+    title << " " << z.name << ": " << z.ms << "ms";
+  }
+  glfwSetWindowTitle(core.window.glfw_window, title.str().c_str());
+}
+}
+
+namespace mocha
+{
+void setGpuProfiler(bool enabled)
+{
+  core.profiler.gpu_enabled = enabled;
+}
+
+// the window has no text rendering, timings are shown in the title bar
+void setGpuOverlay(bool enabled)
+{
+  core.profiler.gpu_overlay = enabled;
+  if (!enabled && !core.window.headless)
+  {
+    glfwSetWindowTitle(core.window.glfw_window, core.window.title.c_str());
+  }
+}
+
+// timestamps instead of GL_TIME_ELAPSED so zones can nest
+void gpuZoneBegin(const char* name)
+{
+  if (!core.profiler.gpu_enabled || !onRenderThread()) return;
+
+  GpuFrame& frame = core.profiler.gpu_frames[core.profiler.gpu_frame];
+  GpuZoneQuery z = {name, nextQuery(frame), 0};
+  glQueryCounter(z.begin, GL_TIMESTAMP);
+
+  core.profiler.gpu_stack.push_back(frame.zones.size());
+  frame.zones.push_back(z);
+}
+
+void gpuZoneEnd()
+{
+  if (!core.profiler.gpu_enabled || !onRenderThread() || core.profiler.gpu_stack.empty()) return;
+
+  GpuFrame& frame = core.profiler.gpu_frames[core.profiler.gpu_frame];
+  GpuZoneQuery& z = frame.zones[core.profiler.gpu_stack.back()];
+  core.profiler.gpu_stack.pop_back();
+
+  z.end = nextQuery(frame);
+  glQueryCounter(z.end, GL_TIMESTAMP);
+}
+
+// milliseconds of the last resolved frame, -1 if the zone was not recorded
+double getGpuZoneTime(const char* name)
+{
+  for (const ZoneTime& z : core.profiler.gpu_results)
+  {
+    if (strcmp(z.name, name) == 0) return z.ms;
+  }
+  return -1.0;
+}
+
+const std::vector<ZoneTime>& getGpuZoneTimes()
+{
+  return core.profiler.gpu_results;
+}
+
+// called once per frame after the last gpu zone
+void advanceGpuProfiler()
+{
+  if (!core.profiler.gpu_enabled) return;
+
+  core.profiler.gpu_stack.clear();
+  core.profiler.gpu_frame = (core.profiler.gpu_frame + 1) % GPU_QUERY_FRAMES;
+  resolveGpuFrame(core.profiler.gpu_frames[core.profiler.gpu_frame]);
+
+  // the title can only be set from the main thread
+  if (core.profiler.gpu_overlay && !core.window.headless && !core.pipeline.enabled) updateOverlay();
+}
+
+uint64_t profilerNow()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// names are kept for the whole run so events can point at them
+const char* internName(const std::string& name)
+{
+  std::lock_guard<std::mutex> lock(core.profiler.threads_mutex);
+  return core.profiler.names.insert(name).first->c_str();
+}
+
+const char* typeName(const std::type_info& type)
+{
+  std::string name = type.name();
+  #ifdef __GNUG__
+    int status;
+    char* demangled = abi::__cxa_demangle(type.name(), NULL, NULL, &status);
+    if (status == 0) name = demangled;
+    free(demangled);
+  #endif
+  return internName(name);
+}
+
+void setProfiler(bool enabled)
+{
+  if (enabled && core.profiler.origin == 0) core.profiler.origin = profilerNow();
+  core.profiler.cpu_enabled = enabled;
+}
+
+void recordZone(const char* name, uint64_t start, uint64_t end)
+{
+  if (!thread_trace) thread_trace = registerThread();
+  ThreadTrace& t = *thread_trace;
+
+  // never blocks or allocates, a full ring drops until the next clear
+  uint64_t head = t.head.load(std::memory_order_relaxed);
+  if (head - t.start.load(std::memory_order_acquire) >= CPU_TRACE_CAPACITY)
+  {
+    t.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  t.events[head % CPU_TRACE_CAPACITY] = {name, start, end};
+  t.head.store(head + 1, std::memory_order_release);
+}
+
+CpuZone::CpuZone(const char* n) : name(n), start(0)
+{
+  if (core.profiler.cpu_enabled) start = profilerNow();
+}
+
+CpuZone::~CpuZone()
+{
+  if (start) recordZone(name, start, profilerNow());
+}
+
+void clearTrace()
+{
+  std::lock_guard<std::mutex> lock(core.profiler.threads_mutex);
+  for (ThreadTrace* t : core.profiler.threads)
+  {
+    t->start.store(t->head.load(std::memory_order_acquire), std::memory_order_release);
+    t->dropped.store(0, std::memory_order_relaxed);
+  }
+}
+
+void setLuaProfiler(bool enabled, int instructions)
+{
+  core.profiler.lua_enabled = enabled;
+  core.profiler.lua_interval = instructions;
+  applyLuaProfiler();
+}
+
+// also called once the lua state exists
+void applyLuaProfiler()
+{
+  lua_State* L = core.lua.state;
+  if (!L) return;
+
+  if (core.profiler.lua_enabled)
+  {
+    lua_sethook(L, luaHook, LUA_MASKCOUNT, core.profiler.lua_interval);
+  } else {
+    lua_sethook(L, NULL, 0, 0);
+  }
+}
+
+// around every call from the engine into lua
+void luaProfileBegin()
+{
+  if (!core.profiler.lua_enabled) return;
+  core.profiler.lua_last = profilerNow();
+  core.profiler.lua_current = nullptr;
+}
+
+void luaProfileEnd()
+{
+  auto& prof = core.profiler;
+  if (!prof.lua_enabled || !prof.lua_current) return;
+  if (prof.cpu_enabled) recordZone(prof.lua_current, prof.lua_run_start, prof.lua_last);
+  prof.lua_current = nullptr;
+}
+
+void clearLuaProfile()
+{
+  core.profiler.lua_functions.clear();
+  core.profiler.lua_lookup.clear();
+  forgetLuaSources();
+}
+
+// chunk sources are matched by address, a new chunk may reuse a freed one
+void forgetLuaSources()
+{
+  core.profiler.lua_sources.clear();
+  core.profiler.lua_last_source = {nullptr, 0};
+}
+
+// sampled time per script function since the last clear, slowest first
+std::vector<LuaFunctionTime> getLuaProfile()
+{
+  std::vector<LuaFunctionTime> functions = core.profiler.lua_functions;
+  std::sort(functions.begin(), functions.end(), [](const LuaFunctionTime& a, const LuaFunctionTime& b) {
+    return a.ms > b.ms;
+  });
+  return functions;
+}
+
+// chrome about:tracing / perfetto json, other threads keep recording while it is written
+bool saveTrace(const std::string& path)
+{
+  std::ofstream file(path);
+  if (!file.is_open())
+  {
+    log(LogLevel::ERROR, "Failed to write: " + path);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(core.profiler.threads_mutex);
+  uint64_t origin = core.profiler.origin;
+
+  file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  for (ThreadTrace* t : core.profiler.threads)
+  {
+    // slots below head are published, the writer cannot reach them again before a clear
+    uint64_t begin = t->start.load(std::memory_order_acquire);
+    uint64_t end = t->head.load(std::memory_order_acquire);
+    size_t dropped = t->dropped.load(std::memory_order_relaxed);
+
+    file << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t->tid
+         << ",\"args\":{\"name\":\"" << (t->tid == 0 ? "main" : "thread " + std::to_string(t->tid)) << "\"}}";
+    first = false;
+
+    if (dropped > 0)
+    {
+      log(LogLevel::WARNING, "Trace buffer full, dropped " + std::to_string(dropped) + " zones!");
+    }
+
+    for (uint64_t i=begin; i<end; i++)
+    {
+      const CpuZoneEvent& e = t->events[i % CPU_TRACE_CAPACITY];
+      file << ",\n{\"name\":";
+      writeJsonString(file, e.name);
+      file << ",\"ph\":\"X\",\"pid\":0,\"tid\":" << t->tid
+           << ",\"ts\":" << (e.start - origin) / 1000.0
+           << ",\"dur\":" << (e.end - e.start) / 1000.0 << "}";
+    }
+  }
+  file << "\n]}\n";
+  return true;
+}
+
+}
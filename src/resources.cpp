@@ -8,6 +8,7 @@ namespace mocha
 {
 std::string loadFile(const std::string& path)
 {
+  MOCHA_ZONE("loadFile")
   std::string s = core.assets.path;
   s = s.append(path);
   std::ifstream file(s);
@@ -27,6 +28,15 @@ std::string loadFile(const std::string& path)
 
 Shader loadShader(const std::string& name)
 {
+  // gl objects are created on the thread that owns the context
+  if (!onRenderThread())
+  {
+    Shader shader;
+    runOnRenderThread([&] { shader = loadShader(name); });
+    return shader;
+  }
+
+  MOCHA_ZONE("loadShader")
   std::string v_path = "shaders/" + name + ".vs";
   std::string v_string = loadFile(v_path);
   const char* v_shader = v_string.c_str();
@@ -49,6 +59,13 @@ Shader loadShader(const std::string& name)
   glAttachShader(id, vertex);
   glAttachShader(id, fragment);
   glLinkProgram(id);
+
+  // per frame camera data is shared between all programs
+  unsigned int frame_block = glGetUniformBlockIndex(id, "Frame");
+  if (frame_block != GL_INVALID_INDEX)
+  {
+    glUniformBlockBinding(id, frame_block, FRAME_UBO_BINDING);
+  }
   
   glDeleteShader(vertex);
   glDeleteShader(fragment);
@@ -57,9 +74,16 @@ Shader loadShader(const std::string& name)
   return {id};
 }
 
-Model loadModel(const std::string& name)
+Model loadModel(const std::string& name, int flags)
 {
+  if (!onRenderThread())
+  {
+    Model m;
+    runOnRenderThread([&] { m = loadModel(name, flags); });
+    return m;
+  }
 
+  MOCHA_ZONE("loadModel")
   // file handling
   std::string path = "models/" + (std::string)name + ".obj";
 
@@ -147,6 +171,84 @@ Model loadModel(const std::string& name)
     }
   }
 
+  Model m;
+
+  // missing files and files without faces give an empty model, it draws nothing
+  if (vertices.empty() || indices.empty())
+  {
+    log(LogLevel::ERROR, "Model has no faces: " + path);
+    return m;
+  }
+
+  // bounding sphere for lod selection
+  glm::vec3 min = vertices[0].position, max = vertices[0].position;
+  for (const Vertex& v : vertices)
+  {
+    min = glm::min(min, v.position);
+    max = glm::max(max, v.position);
+  }
+  m.center = (min + max) * 0.5f;
+  for (const Vertex& v : vertices)
+  {
+    m.radius = std::max(m.radius, glm::length(v.position - m.center));
+  }
+
+  // obj face order is not cache friendly
+  float acmr_before = getACMR(indices, vertices.size());
+  optimizeVertexCache(indices, vertices.size());
+
+  // every lod halves the triangles, all lods share the vertices and live in one index buffer
+  std::vector<unsigned int> lod = indices;
+  m.lods[0] = {(int)indices.size(), 0};
+  while (m.lod_count < MAX_LODS && lod.size() / 3 >= LOD_MIN_TRIANGLES)
+  {
+    std::vector<unsigned int> next = simplifyMesh(vertices, lod, lod.size() / 6 * 3);
+    if (next.size() > lod.size() * 3 / 4) break;
+    optimizeVertexCache(next, vertices.size());
+
+    m.lods[m.lod_count++] = {(int)next.size(), (int)indices.size()};
+    indices.insert(indices.end(), next.begin(), next.end());
+    lod = std::move(next);
+  }
+
+  // lod 0 comes first in the index buffer, so its vertices end up first in memory
+  optimizeVertexFetch(vertices, indices);
+
+  std::vector<unsigned int> lod0(indices.begin(), indices.begin() + m.lods[0].indices_count);
+  log(LogLevel::INFO, name + " ACMR: " + std::to_string(acmr_before) 
+                    + " -> " + std::to_string(getACMR(lod0, vertices.size())));
+
+  // packed vertices are decoded by folding the quantization box into the model transform
+  std::vector<PackedVertex> packed;
+  const void* vertex_data = &vertices[0];
+  if (flags & kModelCompressed)
+  {
+    packed = packVertices(vertices, min, max);
+    vertex_data = &packed[0];
+    m.format = kVertexPacked;
+    m.quant_offset = min;
+    m.quant_scale = max - min;
+  }
+  size_t vertex_bytes = vertices.size() * vertexStride(m.format);
+
+  // most meshes fit 16 bit indices
+  std::vector<unsigned short> short_indices;
+  const void* index_data = &indices[0];
+  if (vertices.size() < 65536)
+  {
+    short_indices.assign(indices.begin(), indices.end());
+    index_data = &short_indices[0];
+    m.index_type = GL_UNSIGNED_SHORT;
+  }
+  size_t index_bytes = indices.size() * indexSize(m.index_type);
+
+  if ((flags & kModelPooled) && allocPooled(vertex_data, vertices.size(), index_data, indices.size(), m))
+  {
+    m.indices_count = m.lods[0].indices_count;
+    for (int i=0; i<m.lod_count; i++) m.lods[i].first_index += m.first_index;
+    return m;
+  }
+
   unsigned int vao, vbo, ebo;
 
   glGenVertexArrays(1, &vao);
@@ -156,11 +258,47 @@ Model loadModel(const std::string& name)
   glBindVertexArray(vao);
   glBindBuffer(GL_ARRAY_BUFFER, vbo);
 
-  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+  glBufferData(GL_ARRAY_BUFFER, vertex_bytes, vertex_data, GL_STATIC_DRAW);
 
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_bytes, index_data, GL_STATIC_DRAW);
   
+  setVertexAttribs(m.format);
+
+  glBindVertexArray(0);
+
+  m.vao = vao;
+  m.indices_count = m.lods[0].indices_count;
+  return m;
+}
+
+size_t vertexStride(int format)
+{
+  return format == kVertexPacked ? sizeof(PackedVertex) : sizeof(Vertex);
+}
+
+size_t indexSize(unsigned int type)
+{
+  return type == GL_UNSIGNED_SHORT ? sizeof(unsigned short) : sizeof(unsigned int);
+}
+
+// expects the vertex buffer to be bound
+void setVertexAttribs(int format)
+{
+  if (format == kVertexPacked)
+  {
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)0);
+
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, tex_coord));
+
+    // octahedral, no shader reads normals yet
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, normal));
+    return;
+  }
+
   glEnableVertexAttribArray(0);
   glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
 
@@ -169,13 +307,6 @@ Model loadModel(const std::string& name)
 
   glEnableVertexAttribArray(2);
   glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
-
-  glBindVertexArray(0);
-
-  Model m;
-  m.vao = vao;
-  m.indices_count = indices.size();
-  return m;
 }
 
 }
\ No newline at end of file
@@ -3,63 +3,123 @@
 #include <mocha.hpp>
 #include <utils.hpp>
 #include <core.hpp>
+#include <ecs.tpp>
 
-namespace mocha
+namespace
 {
-class RenderSys : public System
+// shader first, then buffers, then position in the index buffer
+uint64_t renderKey(mocha::Shader shader, const mocha::Model& m)
 {
- public:
-  void update()
-  {
-    for (Entity e : ecs::view<ecs::Render, ecs::Position>())
-    {
-      const auto& model = ecs::get<ecs::Render>(e);
-      const auto& pos  = ecs::get<ecs::Position>(e);
-
-      drawModel(model, pos.trans);
-    }
-  }
-};
+  return (uint64_t)(shader.id & 0xffff) << 48 
+       | (uint64_t)(m.vao & 0xffff) << 32 
+       | (uint64_t)(uint32_t)m.first_index;
+}
+}
 
+namespace mocha
+{
+// runs at the fixed tick rate, velocity is in units per second
 class PhysicsSys : public System
 {
   void update()
   {
+    auto& positions = ecs::getSet<ecs::Position>();
+
     for (Entity e : ecs::view<ecs::Position, ecs::Physics>())
     {
-      const auto& pos = ecs::get<ecs::Position>(e);
+      auto& pos = positions.get(e);
       const auto& phys = ecs::get<ecs::Physics>(e);
-      
-      glm::vec3 newpos;
-      newpos = pos.pos + phys.velocity;
-      glm::mat4 newtrans = glm::mat4(1.0f);
-      newtrans = glm::translate(newtrans, newpos);
 
-      ecs::Position p = {newpos, newtrans};
-      ecs::Physics ph = {phys.speed, {0.0f, 0.0f, 0.0f}};
+      if (!ecs::has<ecs::Interpolated>(e))
+      {
+        ecs::emplace<ecs::Interpolated>(e, {pos.pos});
+      }
+      ecs::getSet<ecs::Interpolated>().get(e).previous = pos.pos;
 
-      ecs::emplace<ecs::Position>(e, p);
-      ecs::emplace<ecs::Physics>(e, ph);
+      pos.pos = pos.pos + phys.velocity * getFixedDT();
+      pos.trans[3] = glm::vec4(pos.pos, 1.0f);
     }
   }
 };
 
+// only keys that changed or are held dispatch, bindings are looked up by key
 class InputSys : public System
 {
   void update()
   {
-    for (Entity e : ecs::view<ecs::InputBindings>())
+    auto& in = core.input;
+    if (ecs::getSet<ecs::InputBindings>().getVersion() != in.actions_version) compileActions();
+
+    // a tap inside one frame fires both its press and its release
+    for (int key : in.changed_keys)
+    {
+      if (in.pressed_keys[key]) dispatch(key, KeyState::kPressed);
+      if (in.released_keys[key]) dispatch(key, KeyState::kReleased);
+    }
+    for (int key : in.down_keys)
+    {
+      if (!in.pressed_keys[key] && !in.released_keys[key]) dispatch(key, KeyState::kDown);
+    }
+    // up while the key was not held at either end of the frame, kUp bindings fire on
+    // most frames so they are kept in one list and checked every frame
+    for (const ActionBinding& a : in.up_actions)
+    {
+      if (!in.current_key_states[a.key] && !in.previous_key_states[a.key]) use(a);
+    }
+  }
+
+  void dispatch(int key, KeyState state)
+  {
+    auto& in = core.input;
+    for (size_t i=in.actions_offset[key]; i<in.actions_offset[key+1]; i++)
     {
-      std::map<std::pair<int, KeyState>, Command*> ib = ecs::get<ecs::InputBindings>(e);
+      if (in.actions[i].state == state) use(in.actions[i]);
+    }
+  }
 
-      for (auto& [pair, command] : ib)
+  void use(const ActionBinding& a)
+  {
+    Entity e = a.entity;
+    a.command->use(e);
+  }
+
+  // counting sort of all bindings into one flat table, only rebuilt when the set's version
+  // changes, so bindings are changed by removing and emplacing them
+  void compileActions()
+  {
+    auto& in = core.input;
+    auto& set = ecs::getSet<ecs::InputBindings>();
+    const auto& entities = set.getEntities();
+    const auto& bindings = set.getComponents();
+
+    in.actions.clear();
+    in.up_actions.clear();
+    size_t counts[MAX_KEYS+1] = {};
+
+    for (size_t i=0; i<entities.size(); i++)
+    {
+      for (auto& [pair, command] : bindings[i])
       {
-        if (getKeyState(pair.first) == pair.second)
+        if (pair.first < 0 || pair.first >= MAX_KEYS) continue;
+        ActionBinding a = {pair.first, pair.second, entities[i], command};
+        if (a.state == KeyState::kUp)
         {
-          command->use(e);
+          in.up_actions.push_back(a);
+        } else {
+          in.actions.push_back(a);
+          counts[a.key+1]++;
         }
       }
     }
+
+    for (int k=0; k<MAX_KEYS; k++) counts[k+1] += counts[k];
+    memcpy(in.actions_offset, counts, sizeof(counts));
+
+    std::vector<ActionBinding> sorted(in.actions.size());
+    for (const ActionBinding& a : in.actions) sorted[counts[a.key]++] = a;
+    in.actions.swap(sorted);
+
+    in.actions_version = set.getVersion();
   }
 };
 
@@ -68,10 +128,21 @@ class CameraSys : public System
  public:
   void update()
   {
+    bool looked = false;
     for (Entity e : ecs::view<ecs::Camera3D, ecs::Position>())
     {
       const auto& cam = ecs::get<ecs::Camera3D>(e);
       const auto& pos = ecs::get<ecs::Position>(e);
+
+      // mouse look from the frame's summed delta, applied once for the active camera
+      bool active = !core.render.cam_current || *core.render.cam_current == e;
+      if (active && !looked)
+      {
+        glm::vec2 delta = getMouseDelta();
+        core.render.yaw += delta.x * cam.sens;
+        core.render.pitch = std::clamp(core.render.pitch - delta.y * cam.sens, -89.0f, 89.0f);
+        looked = true;
+      }
       
       glm::vec3 front;
       glm::vec3 right;
@@ -96,7 +167,66 @@ class CameraSys : public System
       newcam.view = view;
       newcam.projection = projection;
       ecs::emplace<ecs::Camera3D>(e, newcam);
+
+      // only the active camera feeds the frame uniforms
+      if (core.render.cam_current && *core.render.cam_current != e) continue;
+
+      core.render.frame.view = view;
+      core.render.frame.projection = projection;
+      core.render.frame.view_projection = projection * view;
+      core.render.frame.camera_position = glm::vec4(pos.pos, 1.0f);
+      core.render.frame.time = (float)core.window.current;
+      uploadFrameData(core.render.frame);
     }
   }
 };
+
+void initSystems()
+{
+  ecs::addFixedSystem(new PhysicsSys());
+
+  ecs::addInputSystem(new InputSys());
+  ecs::addSystem(new CameraSys());
+}
+
+// copy what drawing needs out of the component sets, walks the dense models once
+void extractRenderList()
+{
+  auto& list = core.render.render_list;
+  auto& transforms = core.render.render_transforms;
+  list.clear();
+  transforms.clear();
+
+  auto& models = ecs::getSet<ecs::Render>();
+  auto& positions = ecs::getSet<ecs::Position>();
+  auto& interpolated = ecs::getSet<ecs::Interpolated>();
+  const auto& entities = models.getEntities();
+  const auto& components = models.getComponents();
+  Shader shader = core.render.current_shader;
+  float alpha = getAlpha();
+
+  for (size_t i=0; i<entities.size(); i++)
+  {
+    Entity e = entities[i];
+    if (!positions.has(e)) continue;
+    const auto& pos = positions.get(e);
+
+    // simulated entities are drawn between their last two fixed steps
+    glm::mat4 trans = pos.trans;
+    if (interpolated.has(e))
+    {
+      glm::vec3 previous = interpolated.get(e).previous;
+      trans[3] = glm::vec4(glm::mix(previous, pos.pos, alpha), 1.0f);
+    }
+
+    Model m = getLod(components[i], selectLod(components[i], trans));
+    list.push_back({renderKey(shader, m), shader.id, m.vao, m.index_type, m.pool, 
+                    m.first_index, m.base_vertex, m.indices_count, (uint32_t)transforms.size()});
+    transforms.push_back(trans * getDecodeTransform(m));
+  }
+
+  std::sort(list.begin(), list.end(), [](const RenderItem& a, const RenderItem& b) {
+    return a.key < b.key;
+  });
+}
 }
\ No newline at end of file
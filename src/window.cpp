@@ -6,6 +6,8 @@
 
 #ifdef LINUX
   #include <unistd.h>
+  #include <time.h>
+  #include <errno.h>
 #endif
 
 #ifdef WINDOWS
@@ -17,11 +19,25 @@ namespace mocha
 
 // Predefine 
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
+void cursorPosCallback(GLFWwindow* window, double x, double y);
+void scrollCallback(GLFWwindow* window, double x, double y);
 void windowSizeCallback(GLFWwindow* window, int width, int height);
+void initOffscreen(int width, int height);
 
 void initWindow(int width, int height, const char* title)
 {
   log(LogLevel::INFO, "Starting Mocha Engine...");
+
+  #ifdef LINUX
+    // no display server, software context without any window system
+    bool no_display = !getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY");
+    if (core.window.headless && no_display)
+    {
+      glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+    }
+  #endif
+
   if (!glfwInit())
   {
     log(LogLevel::FATAL, "GLFW INIT FAILED!");
@@ -32,6 +48,14 @@ void initWindow(int width, int height, const char* title)
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+  if (core.window.headless)
+  {
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    #ifdef LINUX
+      if (no_display) glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+    #endif
+  }
+
   core.window.glfw_window = glfwCreateWindow(width, height, title, NULL, NULL);
 
   if (!core.window.glfw_window)
@@ -49,72 +73,260 @@ void initWindow(int width, int height, const char* title)
   }
 
   // opengl settings
-  glfwSetInputMode(core.window.glfw_window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+  if (core.window.headless)
+  {
+    initOffscreen(width, height);
+  } else {
+    glfwSetInputMode(core.window.glfw_window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    setRawMouseMotion(true);
+  }
 
   glEnable(GL_DEPTH_TEST);
 
   // input callbacks
   glfwSetKeyCallback(core.window.glfw_window, keyCallback);
-  // mouse button callback
-  // mouse pos callback
+  glfwSetMouseButtonCallback(core.window.glfw_window, mouseButtonCallback);
+  glfwSetCursorPosCallback(core.window.glfw_window, cursorPosCallback);
+  glfwSetScrollCallback(core.window.glfw_window, scrollCallback);
 
   // core settings
+  core.window.title = title;
   core.window.fps = 1.0/60.0;
+  setFrameMode(kFrameFixed);
   core.window.previous = 0;
   core.assets.path = "assets/";
+  core.assets.scripts = "scripts/";
+  core.assets.cache = "cache/";
   core.render.world_up = {0.0f, 1.0f, 0.0f};
   core.window.size = {width, height};
   core.render.yaw = -90.0f;
   core.render.pitch = 0.0f;
 
   // add systems
+  initSystems();
+  luaBindings();
   log(LogLevel::DEBUG, "WINDOW DONE!");
 }
 
+void initHeadless(int width, int height)
+{
+  core.window.headless = true;
+  initWindow(width, height, "Mocha");
+}
+
+// headless frames render into an fbo instead of the default framebuffer
+void initOffscreen(int width, int height)
+{
+  auto& off = core.window.offscreen;
+
+  glGenFramebuffers(1, &off.fbo);
+  glGenRenderbuffers(1, &off.color);
+  glGenRenderbuffers(1, &off.depth);
+
+  glBindRenderbuffer(GL_RENDERBUFFER, off.color);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, off.depth);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, off.fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, off.color);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, off.depth);
+
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+  {
+    log(LogLevel::FATAL, "OFFSCREEN FRAMEBUFFER INCOMPLETE!");
+  }
+
+  glViewport(0, 0, width, height);
+}
+
+void closeWindow()
+{
+  stopPipeline();
+  closeLua();
+  stopInputRecording();
+
+  FrameStats stats = getFrameStats();
+  std::ostringstream msg;
+  msg << "Frame time avg " << stats.average_ms << "ms, min " << stats.min_ms << "ms, max " 
+      << stats.max_ms << "ms, jitter " << stats.jitter_ms << "ms, wake error " << stats.wake_error_ms << "ms";
+  log(LogLevel::INFO, msg.str());
+
+  if (core.window.headless)
+  {
+    auto& off = core.window.offscreen;
+    glDeleteFramebuffers(1, &off.fbo);
+    glDeleteRenderbuffers(1, &off.color);
+    glDeleteRenderbuffers(1, &off.depth);
+  }
+
+  glfwDestroyWindow(core.window.glfw_window);
+  glfwTerminate();
+}
+
 bool windowShouldClose()
 {
+  if (core.window.max_frames > 0 && core.window.frame >= core.window.max_frames) return true;
+  if (core.input.replay_done) return true;
   return getKeyDown(Key::kESCAPE);
 }
 
+// sleep most of the way, then spin the last PACER_SPIN_MARGIN for precision
+void waitUntil(double target)
+{
+  double remaining = target - glfwGetTime() - PACER_SPIN_MARGIN;
+  if (remaining > 0.0)
+  {
+    #ifdef LINUX
+      timespec ts;
+      ts.tv_sec = (time_t)remaining;
+      ts.tv_nsec = (long)((remaining - ts.tv_sec) * 1e9);
+      while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR) {}
+    #else
+      std::this_thread::sleep_for(std::chrono::duration<double>(remaining));
+    #endif
+  }
+
+  while (glfwGetTime() < target) {}
+}
+
+// fixed rate frames start on a schedule, so sleep errors do not accumulate
+void paceFrame()
+{
+  if (core.window.frame_mode != kFrameFixed) return;
+
+  double now = glfwGetTime();
+
+  // too far behind, start a new schedule instead of rushing to catch up
+  if (core.window.deadline == 0.0 || now - core.window.deadline > core.window.fps)
+  {
+    core.window.deadline = now;
+  } else {
+    waitUntil(core.window.deadline);
+  }
+
+  core.window.wake_error = glfwGetTime() - core.window.deadline;
+  core.window.deadline += core.window.fps;
+}
+
 bool Begin()
 {
+  paceFrame();
+
   // update delta time
   core.window.current = glfwGetTime();
   core.window.delta = core.window.current - core.window.previous;
   core.window.previous = core.window.current;
 
-  if (core.window.delta < core.window.fps)
+  // the first frame would measure window, gl and asset startup, count it as one target frame
+  if (core.window.frame == 0) core.window.delta = core.window.fps;
+
+  int slot = core.window.frame % FRAME_HISTORY;
+  core.window.frame_history[slot] = core.window.delta;
+  core.window.wake_history[slot] = core.window.wake_error;
+
+  if (core.window.headless)
   {
-    #ifdef LINUX
-      sleep(core.window.fps - core.window.delta);
-    #endif
-    core.window.delta = core.window.fps;
+    core.window.frame_times.push_back(core.window.delta);
   }
+  core.window.frame++;
 
-  // handle inputs
+  // handle inputs, a replay also sets the delta from here on
   glfwPollEvents();
+  drainInput();
+  pollScripts();
+
+  // the render thread clears when it picks up the packet
+  if (core.pipeline.enabled) return !windowShouldClose();
+
+  if (core.window.headless)
+  {
+    glBindFramebuffer(GL_FRAMEBUFFER, core.window.offscreen.fbo);
+  }
 
   // clear screen
+  gpuZoneBegin("clear");
   clearColor(BLACK);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  gpuZoneEnd();
 
   return !windowShouldClose();
 }
 
 void End()
 {
+  MOCHA_ZONE("End")
+  stepLuaGC();
+
+  if (core.pipeline.enabled)
+  {
+    submitPacket();
+    return;
+  }
+  presentPacket(simPacket());
+}
+
+// draw what was collected for the frame and swap, on the thread owning the context
+void presentPacket(RenderPacket& packet)
+{
+  gpuZoneBegin("models");
+  flushModels(packet);
+  gpuZoneEnd();
+
+  gpuZoneBegin("static");
+  flushStatic(packet);
+  gpuZoneEnd();
+
+  gpuZoneBegin("debug draw");
+  flushBatch(packet);
+  gpuZoneEnd();
+
+  if (!packet.screenshot.empty())
+  {
+    takeScreenshot(packet.screenshot);
+    packet.screenshot.clear();
+  }
+
+  advanceGpuProfiler();
+  advanceDynamicBuffers();
+
+  // nothing to present offscreen
+  MOCHA_ZONE("swap")
+  if (core.window.headless)
+  {
+    glFlush();
+    return;
+  }
   glfwSwapBuffers(core.window.glfw_window);
 }
 
 // Callbacks
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
-  core.input.previous_key_states[key] = core.input.current_key_states[key];
-  core.input.current_key_states[key] = action == GLFW_PRESS;
+  // repeats do not change the key state
+  if (action == GLFW_REPEAT) return;
+  pushInputEvent({glfwGetTime(), kInputKey, key, action});
+}
+
+void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+  pushInputEvent({glfwGetTime(), kInputMouseButton, button, action, 0.0f, 0.0f});
+}
+
+void cursorPosCallback(GLFWwindow* window, double x, double y)
+{
+  pushInputEvent({glfwGetTime(), kInputCursor, 0, 0, (float)x, (float)y});
+}
+
+void scrollCallback(GLFWwindow* window, double x, double y)
+{
+  pushInputEvent({glfwGetTime(), kInputScroll, 0, 0, (float)x, (float)y});
 }
 
 void windowSizeCallback(GLFWwindow* window, int width, int height)
 {
+  if (deferToRenderThread([=] { glViewport(0, 0, width, height); })) return;
   glViewport(0, 0, width, height);
 }
 
@@ -125,6 +337,43 @@ void setFPS(int fps)
   core.window.fps = 1.0/(double)fps;
 }
 
+void setFrameMode(FrameMode mode)
+{
+  core.window.frame_mode = mode;
+  core.window.deadline = 0.0;
+  runOnRenderThread([=] { glfwSwapInterval(mode == kFrameVsync ? 1 : 0); });
+}
+
+// statistics over the last FRAME_HISTORY frames
+FrameStats getFrameStats()
+{
+  int count = std::min(core.window.frame, FRAME_HISTORY);
+  FrameStats stats = {};
+  if (count == 0) return stats;
+
+  stats.min_ms = DBL_MAX;
+  double sum = 0.0, wake = 0.0;
+  for (int i=0; i<count; i++)
+  {
+    double ms = core.window.frame_history[i] * 1000.0;
+    sum += ms;
+    wake += std::abs(core.window.wake_history[i]) * 1000.0;
+    stats.min_ms = std::min(stats.min_ms, ms);
+    stats.max_ms = std::max(stats.max_ms, ms);
+  }
+  stats.average_ms = sum / count;
+  stats.wake_error_ms = wake / count;
+
+  double variance = 0.0;
+  for (int i=0; i<count; i++)
+  {
+    double d = core.window.frame_history[i] * 1000.0 - stats.average_ms;
+    variance += d * d;
+  }
+  stats.jitter_ms = sqrt(variance / count);
+  return stats;
+}
+
 int getFPS()
 {
   return (int)(1.0/core.window.fps);
@@ -135,4 +384,61 @@ float getDT()
   return core.window.delta;
 }
 
+void setMaxFrames(int frames)
+{
+  core.window.max_frames = frames;
+}
+
+// binary ppm of the frame drawn so far, call before End
+bool takeScreenshot(const std::string& path)
+{
+  // pipelined frames are read back once the render thread drew them
+  if (!onRenderThread())
+  {
+    simPacket().screenshot = path;
+    return true;
+  }
+
+  int width = core.window.size.x;
+  int height = core.window.size.y;
+  std::vector<unsigned char> pixels(width * height * 3);
+
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file.is_open())
+  {
+    log(LogLevel::ERROR, "Failed to write: " + path);
+    return false;
+  }
+
+  file << "P6\n" << width << " " << height << "\n255\n";
+
+  // gl rows start at the bottom
+  for (int y=height-1; y>=0; y--)
+  {
+    file.write((const char*)&pixels[y * width * 3], width * 3);
+  }
+  return true;
+}
+
+// one frame time in milliseconds per line, recorded in headless mode
+bool saveFrameTimes(const std::string& path)
+{
+  std::ofstream file(path);
+  if (!file.is_open())
+  {
+    log(LogLevel::ERROR, "Failed to write: " + path);
+    return false;
+  }
+
+  file << "frame,ms\n";
+  for (size_t i=0; i<core.window.frame_times.size(); i++)
+  {
+    file << i << "," << core.window.frame_times[i] * 1000.0 << "\n";
+  }
+  return true;
+}
+
 }
\ No newline at end of file